@@ -0,0 +1,87 @@
+#ifndef ALLOCATION_H
+#define ALLOCATION_H
+
+// Counting replacements for the global operator new and delete, so a render
+// can check how many heap allocations a frame makes. Only allocations are
+// counted; the count is shared by every thread and read with
+// HeapAllocations().
+//
+// The replacements are only compiled in with -DCOUNT_ALLOCATIONS (make
+// alloc-check), so normal builds keep the standard allocator and pay no
+// shared atomic per allocation. With the switch, this header replaces the
+// global allocator and must be included by exactly one translation unit.
+#include <atomic>
+#include <new>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef COUNT_ALLOCATIONS
+#define ALLOCATIONS_COUNTED true
+
+std::atomic<uint64_t> heapAllocations(0);
+
+inline uint64_t HeapAllocations() {
+    return heapAllocations.load(std::memory_order_relaxed);
+}
+
+inline void* CountedAlloc( size_t size ) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+
+void* operator new( size_t size ) {
+    void* p = CountedAlloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[]( size_t size ) {
+    void* p = CountedAlloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new( size_t size, const std::nothrow_t& ) noexcept   { return CountedAlloc(size); }
+void* operator new[]( size_t size, const std::nothrow_t& ) noexcept { return CountedAlloc(size); }
+
+void operator delete( void* p ) noexcept                            { free(p); }
+void operator delete[]( void* p ) noexcept                          { free(p); }
+void operator delete( void* p, size_t ) noexcept                    { free(p); }
+void operator delete[]( void* p, size_t ) noexcept                  { free(p); }
+void operator delete( void* p, const std::nothrow_t& ) noexcept     { free(p); }
+void operator delete[]( void* p, const std::nothrow_t& ) noexcept   { free(p); }
+
+#ifdef __cpp_aligned_new
+// Over-aligned types, such as the cache-line WideNode
+inline void* CountedAlignedAlloc( size_t size, std::align_val_t align ) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    size_t a = (size_t)align;
+    return aligned_alloc(a, (std::max(size, (size_t)1) + a - 1) / a * a);
+}
+
+void* operator new( size_t size, std::align_val_t align ) {
+    void* p = CountedAlignedAlloc(size, align);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[]( size_t size, std::align_val_t align ) {
+    void* p = CountedAlignedAlloc(size, align);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete( void* p, std::align_val_t ) noexcept           { free(p); }
+void operator delete[]( void* p, std::align_val_t ) noexcept         { free(p); }
+void operator delete( void* p, size_t, std::align_val_t ) noexcept   { free(p); }
+void operator delete[]( void* p, size_t, std::align_val_t ) noexcept { free(p); }
+#endif
+
+#else
+#define ALLOCATIONS_COUNTED false
+
+inline uint64_t HeapAllocations() { return 0; }
+#endif
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+// Edge-aware a-trous wavelet filter for the direct lighting term. Noisy
+// lighting from a few shadow rays per pixel is smoothed with a 3x3 B-spline
+// kernel whose taps spread 1, 2, 4, ... pixels apart on successive passes;
+// taps are weighted down across changes in normal, depth and object, so
+// geometric edges stay sharp, and across changes in brightness larger than
+// the local noise, so shadow edges survive while the noise inside them is
+// smoothed out. Albedo is kept separate and multiplied back in afterwards,
+// so texture detail is never filtered.
+//
+// Buffers are structure-of-arrays with a border of empty pixels wide enough
+// for the largest tap, so every tap can be read without bounds checks. Each
+// pass runs over rows in parallel, gathering all nine taps of a pixel in
+// registers; the loop over a row is kept free of branches so it vectorizes.
+//
+// Each tap reads as little as possible: the light, its variance, and one
+// 32-bit feature word packing the normal, depth and object index. Luminance is
+// recomputed from the light, and the edge weight is a clamped polynomial rather
+// than a ratio, so the only divides are per pixel, not per tap. Empty pixels
+// have a zero feature word, whose object field matches no hit.
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+
+#define DENOISE_PASSES  3
+#define DENOISE_BORDER  (1 << (DENOISE_PASSES - 1))
+#define DENOISE_DEPTH   0.02f    // Depth tolerance per pixel of tap distance
+#define DENOISE_LUMA    2.f      // Luminance tolerance in standard deviations of the noise
+#define DENOISE_NORMAL  2.f      // Edge cost per squared step of the packed normal
+
+// Feature word layout, high bits to low: 15 bits of depth in 1/16ths of
+// DENOISE_DEPTH, 6 bits of object index (modulo 63, plus one so that no hit
+// matches an empty pixel), a zero bit, then the normal octahedrally mapped
+// onto two 5-bit coordinates u and v. Neighbouring objects whose indices
+// collide are still told apart by their normal or depth.
+#define FEATURE_DEPTH_SHIFT  17
+#define FEATURE_DEPTH_MAX    32767
+#define FEATURE_DEPTH_UNITS  (16.f / DENOISE_DEPTH)
+#define FEATURE_ID_SHIFT     11
+#define FEATURE_ID_MASK      0x3f
+#define FEATURE_NORMAL_MAX   31
+
+// Per-pixel inputs from the primary Intersection, plus the lighting being
+// filtered. Each pass reads one of the ping-pong buffers and writes the other.
+struct DenoiseBuffer {
+    int width, height;
+    int stride;                         // Row length including the border
+    std::vector<float> albedo[3];
+    std::vector<float> light[2][3];
+    std::vector<float> variance[2];     // Luminance noise estimate
+    std::vector<uint32_t> feature;      // DenoiseFeature of the primary hit, 0 where nothing was hit
+    int current;                        // Ping-pong buffer holding the latest light
+};
+
+void ResizeDenoiseBuffer( DenoiseBuffer& buf, int width, int height );
+uint32_t DenoiseFeature( float nx, float ny, float nz, float depth, int id );
+void DenoiseLighting( DenoiseBuffer& buf );
+
+// Index of pixel (x, y) in every buffer
+inline int DenoiseIndex( const DenoiseBuffer& buf, int x, int y ) {
+    return (y + DENOISE_BORDER) * buf.stride + x + DENOISE_BORDER;
+}
+
+
+// Buffers are only reallocated when the size changes. The border is never
+// written after that, so it keeps its zero feature word.
+void ResizeDenoiseBuffer( DenoiseBuffer& buf, int width, int height ) {
+    int stride = width + 2 * DENOISE_BORDER;
+    int n = stride * (height + 2 * DENOISE_BORDER);
+    buf.current = 0;
+    if (buf.width == width && buf.height == height && (int)buf.feature.size() == n) return;
+
+    buf.width  = width;
+    buf.height = height;
+    buf.stride = stride;
+    for (int c = 0; c < 3; c++) {
+        buf.albedo[c].assign(n, 0.f);
+        buf.light[0][c].assign(n, 0.f);
+        buf.light[1][c].assign(n, 0.f);
+    }
+    for (int i = 0; i < 2; i++) {
+        buf.variance[i].assign(n, 0.f);
+    }
+    buf.feature.assign(n, 0);
+}
+
+// Pack a hit's unit normal, distance from the camera and object index. Depth
+// is clamped to the 15 bits available, about 40 units at the default tolerance.
+uint32_t DenoiseFeature( float nx, float ny, float nz, float depth, int id ) {
+    float l1 = fabsf(nx) + fabsf(ny) + fabsf(nz);
+    float u = nx / l1, v = ny / l1;
+    if (nz < 0) {
+        float fu = (1.f - fabsf(v)) * (u < 0 ? -1.f : 1.f);
+        float fv = (1.f - fabsf(u)) * (v < 0 ? -1.f : 1.f);
+        u = fu;
+        v = fv;
+    }
+    uint32_t qu = (uint32_t)((u * 0.5f + 0.5f) * FEATURE_NORMAL_MAX + 0.5f);
+    uint32_t qv = (uint32_t)((v * 0.5f + 0.5f) * FEATURE_NORMAL_MAX + 0.5f);
+    uint32_t qz = (uint32_t)std::min(depth * FEATURE_DEPTH_UNITS + 0.5f, (float)FEATURE_DEPTH_MAX);
+    uint32_t qi = (uint32_t)id % FEATURE_ID_MASK + 1;
+    return (qz << FEATURE_DEPTH_SHIFT) | (qi << FEATURE_ID_SHIFT) | (qu << 5) | qv;
+}
+
+inline float Luminance( float r, float g, float b ) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// 1 where two feature words have the same object field, 0 otherwise, without
+// a compare. A branch or select here would stop the variance loop vectorizing.
+inline float SameObject( uint32_t a, uint32_t b ) {
+    uint32_t diff = ((a ^ b) >> FEATURE_ID_SHIFT) & FEATURE_ID_MASK;
+    return (float)(int)(1u - ((diff | (0u - diff)) >> 31));
+}
+
+// Fields of a feature word as floats, for differencing. The object index is
+// read together with u, 64 steps of u apart, so a difference of objects shows
+// up as a difference in u of at least 33, enough to zero any edge weight.
+inline float FeatureDepth( uint32_t f )   { return (float)(int)(f >> FEATURE_DEPTH_SHIFT); }
+inline float FeatureObjectU( uint32_t f ) { return (float)(int)((f >> 5) & 0xfff); }
+inline float FeatureV( uint32_t f )       { return (float)(int)(f & FEATURE_NORMAL_MAX); }
+
+inline float LumaScale( float variance ) {
+    return 1.f / (DENOISE_LUMA * DENOISE_LUMA * variance + 1e-8f);
+}
+
+// Seed the noise estimate with the luminance variance over each pixel's 3x3
+// neighbourhood on the same object
+void EstimateVariance( DenoiseBuffer& buf ) {
+    const int W = buf.width, H = buf.height, S = buf.stride;
+    const float* inR = &buf.light[buf.current][0][0];
+    const float* inG = &buf.light[buf.current][1][0];
+    const float* inB = &buf.light[buf.current][2][0];
+    const uint32_t* feature = &buf.feature[0];
+    // The other variance buffer is not needed until the first pass writes it,
+    // so it holds the luminance meanwhile
+    float* __restrict__ luma     = &buf.variance[1 - buf.current][0];
+    float* __restrict__ variance = &buf.variance[buf.current][0];
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < H; y++) {
+        int row = DenoiseIndex(buf, 0, y);
+        #pragma omp simd
+        for (int p = row; p < row + W; p++) {
+            luma[p] = Luminance(inR[p], inG[p], inB[p]);
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < H; y++) {
+        int row = DenoiseIndex(buf, 0, y);
+        #pragma omp simd
+        for (int p = row; p < row + W; p++) {
+            float sum = 0, sumSq = 0, n = 0;
+            for (int ty = -1; ty <= 1; ty++) {
+                for (int tx = -1; tx <= 1; tx++) {
+                    int q = p + ty * S + tx;
+                    float same = SameObject(feature[p], feature[q]);
+                    sum   += same * luma[q];
+                    sumSq += same * luma[q] * luma[q];
+                    n     += same;
+                }
+            }
+            float mean = sum / n;
+            float v = sumSq / n - mean * mean;
+            variance[p] = 0.5f * (v + fabsf(v));   // Clamp rounding below zero
+        }
+    }
+}
+
+// One a-trous pass with taps step pixels apart, from the current light buffer
+// into the other. The variance is filtered alongside with squared weights, so
+// the luminance tolerance tightens as the noise is removed.
+//
+// Squared differences in depth, luminance and normal are each scaled by their
+// tolerance and summed into a. The edge weight (1 - a/8)^8 follows exp(-a)
+// closely for small differences and reaches zero at a = 8, so it needs no
+// divide or exponential; a change of object always costs more than 8.
+void ATrousPass( DenoiseBuffer& buf, int step ) {
+    const float kernel[3] = {0.25f, 0.5f, 0.25f};
+    const int W = buf.width, H = buf.height, S = buf.stride;
+    int offset[9];
+    float weight[9];
+    for (int k = 0; k < 9; k++) {
+        offset[k] = ((k / 3 - 1) * S + k % 3 - 1) * step;
+        weight[k] = kernel[k / 3] * kernel[k % 3] / 256.f;    // Undoes e + |e| = 2e below
+    }
+    const float depthScale  = 1.f / (FEATURE_DEPTH_UNITS * DENOISE_DEPTH * step);
+    const float depthWeight = depthScale * depthScale / 8.f;
+    const int src = buf.current, dst = 1 - buf.current;
+
+    const float* inR = &buf.light[src][0][0];
+    const float* inG = &buf.light[src][1][0];
+    const float* inB = &buf.light[src][2][0];
+    const float* inV = &buf.variance[src][0];
+    const uint32_t* feature = &buf.feature[0];
+    float* __restrict__ outR = &buf.light[dst][0][0];
+    float* __restrict__ outG = &buf.light[dst][1][0];
+    float* __restrict__ outB = &buf.light[dst][2][0];
+    float* __restrict__ outV = &buf.variance[dst][0];
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < H; y++) {
+        int row = DenoiseIndex(buf, 0, y);
+        #pragma omp simd
+        for (int p = row; p < row + W; p++) {
+            const uint32_t fp = feature[p];
+            const float zp = FeatureDepth(fp);
+            const float up = FeatureObjectU(fp);
+            const float vp = FeatureV(fp);
+            const float lp = Luminance(inR[p], inG[p], inB[p]);
+            const float lumaWeight = LumaScale(inV[p]) / 8.f;
+            float r = 0, g = 0, b = 0, v = 0, sum = 0;
+            #pragma GCC unroll 9
+            for (int k = 0; k < 9; k++) {
+                int q = p + offset[k];
+                const uint32_t fq = feature[q];
+                float dz = FeatureDepth(fq)  - zp;
+                float du = FeatureObjectU(fq) - up;
+                float dv = FeatureV(fq) - vp;
+                float dl = Luminance(inR[q], inG[q], inB[q]) - lp;
+                float e = 1.f - dz * dz * depthWeight - dl * dl * lumaWeight
+                        - (du * du + dv * dv) * (DENOISE_NORMAL / 8.f);
+                e += fabsf(e);
+                e *= e;
+                e *= e;
+                float w = weight[k] * e * e;
+                r   += w * inR[q];
+                g   += w * inG[q];
+                b   += w * inB[q];
+                v   += w * w * inV[q];
+                sum += w;
+            }
+            // The centre tap always has full weight
+            float inv = 1.f / sum;
+            outR[p] = r * inv;
+            outG[p] = g * inv;
+            outB[p] = b * inv;
+            outV[p] = v * inv * inv;
+        }
+    }
+    buf.current = dst;
+}
+
+// Filter the lighting; the result is left in buf.light[buf.current]
+void DenoiseLighting( DenoiseBuffer& buf ) {
+    EstimateVariance(buf);
+    for (int pass = 0; pass < DENOISE_PASSES; pass++) {
+        ATrousPass(buf, 1 << pass);
+    }
+}
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+// Per-pixel cost recording: cycles, rays cast and primitive tests spent on
+// each pixel, written out as a false-colour image, a raw float dump and a
+// per-tile summary.
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include "SDLauxiliary.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+#define HEATMAP_TILE 32
+
+struct CostCounters {
+    uint64_t rays;
+    uint64_t tests;
+};
+
+// Each render thread counts into its own copy; Draw snapshots it around every
+// pixel
+thread_local CostCounters costCounters = {0, 0};
+
+struct HeatmapBuffer {
+    int width, height;
+    std::vector<float> cycles, rays, tests;
+};
+
+inline uint64_t ReadCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+void ResetHeatmap( HeatmapBuffer& heat, int width, int height );
+void WriteHeatmap( const HeatmapBuffer& heat, const char* prefix );
+
+
+void ResetHeatmap( HeatmapBuffer& heat, int width, int height ) {
+    heat.width  = width;
+    heat.height = height;
+    heat.cycles.assign(width * height, 0.f);
+    heat.rays.assign(width * height, 0.f);
+    heat.tests.assign(width * height, 0.f);
+}
+
+// Blue through cyan, green and yellow to red
+glm::vec3 HeatColour( float v ) {
+    const glm::vec3 stops[5] = {glm::vec3(0, 0, 0.5f), glm::vec3(0, 0.8f, 1), glm::vec3(0, 0.9f, 0),
+                                glm::vec3(1, 0.9f, 0), glm::vec3(0.9f, 0, 0)};
+    v = glm::clamp(v, 0.f, 1.f) * 4.f;
+    int i = std::min(3, (int)v);
+    float f = v - i;
+    return stops[i] * (1.f - f) + stops[i + 1] * f;
+}
+
+// Writes <prefix>.bmp (log-scaled cycles), <prefix>.f32 (cycles, rays and
+// tests per pixel as interleaved 32-bit floats, row-major) and
+// <prefix>_tiles.txt, and prints the most expensive tiles
+void WriteHeatmap( const HeatmapBuffer& heat, const char* prefix ) {
+    int n = heat.width * heat.height;
+    std::string base(prefix);
+
+    float lo = std::numeric_limits<float>::max(), hi = 0;
+    for (int i = 0; i < n; i++) {
+        float c = std::max(heat.cycles[i], 1.f);
+        lo = std::min(lo, c);
+        hi = std::max(hi, c);
+    }
+    float range = std::max(logf(hi) - logf(lo), 1e-6f);
+    screen* image = InitializeOffscreen(heat.width, heat.height);
+    for (int y = 0; y < heat.height; y++) {
+        for (int x = 0; x < heat.width; x++) {
+            float c = std::max(heat.cycles[y * heat.width + x], 1.f);
+            PutPixelSDL(image, x, y, HeatColour((logf(c) - logf(lo)) / range));
+        }
+    }
+    SDL_SaveImage(image, (base + ".bmp").c_str());
+    KillOffscreen(image);
+
+    FILE* raw = fopen((base + ".f32").c_str(), "wb");
+    if (raw) {
+        for (int i = 0; i < n; i++) {
+            float v[3] = {heat.cycles[i], heat.rays[i], heat.tests[i]};
+            fwrite(v, sizeof(float), 3, raw);
+        }
+        fclose(raw);
+    }
+
+    // Per-tile totals, as a share of the frame, to expose load imbalance
+    int tilesX = (heat.width  + HEATMAP_TILE - 1) / HEATMAP_TILE;
+    int tilesY = (heat.height + HEATMAP_TILE - 1) / HEATMAP_TILE;
+    std::vector<double> tileCycles(tilesX * tilesY, 0), tileRays(tilesX * tilesY, 0), tileTests(tilesX * tilesY, 0);
+    double total = 0;
+    for (int y = 0; y < heat.height; y++) {
+        for (int x = 0; x < heat.width; x++) {
+            int t = (y / HEATMAP_TILE) * tilesX + x / HEATMAP_TILE;
+            tileCycles[t] += heat.cycles[y * heat.width + x];
+            tileRays[t]   += heat.rays[y * heat.width + x];
+            tileTests[t]  += heat.tests[y * heat.width + x];
+            total         += heat.cycles[y * heat.width + x];
+        }
+    }
+
+    FILE* tiles = fopen((base + "_tiles.txt").c_str(), "w");
+    if (tiles) {
+        fprintf(tiles, "# tile_x tile_y cycles share rays tests\n");
+        for (int t = 0; t < tilesX * tilesY; t++) {
+            fprintf(tiles, "%d %d %.0f %.5f %.0f %.0f\n", t % tilesX, t / tilesX,
+                    tileCycles[t], tileCycles[t] / total, tileRays[t], tileTests[t]);
+        }
+        fclose(tiles);
+    }
+
+    std::vector<int> order(tilesX * tilesY);
+    for (int t = 0; t < tilesX * tilesY; t++) order[t] = t;
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return tileCycles[a] > tileCycles[b]; });
+    double mean = total / (tilesX * tilesY);
+    printf("Frame cost: %.3g cycles, tile max/mean %.2f\n", total, tileCycles[order[0]] / mean);
+    printf("%6s %6s %8s %12s %12s\n", "tile x", "tile y", "share", "rays", "tests");
+    for (int k = 0; k < std::min(10, tilesX * tilesY); k++) {
+        int t = order[k];
+        printf("%6d %6d %7.2f%% %12.0f %12.0f\n", t % tilesX, t / tilesX,
+               100.0 * tileCycles[t] / total, tileRays[t], tileTests[t]);
+    }
+}
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+// Light sources and the hierarchy used to importance sample them when a scene
+// has more emitters than DirectLight can afford to evaluate at every hit.
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <stdint.h>
+
+using glm::vec3;
+using glm::vec4;
+
+struct Light {
+    vec3 colour;
+    vec4 position;
+};
+
+// Binary BVH over Light entries. Leaves hold exactly one light; interior
+// nodes carry the bounds and summed power of everything below them.
+struct LightNode {
+    vec3  lo, hi;
+    float power;
+    int   left, right;  // child node indices, -1 for a leaf
+    int   light;        // index into light_points for leaves, -1 otherwise
+};
+
+struct LightTree {
+    std::vector<LightNode> nodes;
+    std::vector<int>       order;
+};
+
+// Rectangular area light spanned by two edges from a corner. Its radiance is
+// set so the on-axis intensity, colour / 4pi, matches a point light of the
+// same colour, falling off with the cosine to the emitting side.
+struct AreaLight {
+    vec4  corner;
+    vec4  edgeU, edgeV;
+    vec3  normal;
+    vec3  colour;
+    float area;
+};
+
+void  BuildLightTree( LightTree& tree, const std::vector<Light>& light_points );
+int   SampleLightTree( const LightTree& tree, vec3 p, vec3 n, float u, float& pdf );
+float NextRandom( uint32_t& state );
+AreaLight MakeQuadLight( vec4 centre, float halfSize, vec3 colour );
+vec4  SampleAreaLight( const AreaLight& light, float u, float v );
+void  StratifiedSample( int i, int nx, int ny, float offU, float offV, uint32_t& rng, float& u, float& v );
+
+
+// Cheap RNG for per-pixel sampling. The state lives on the caller's stack so
+// threads never share it; HashSeed decorrelates neighbouring pixels.
+uint32_t HashSeed( uint32_t x ) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+float NextRandom( uint32_t& state ) {
+    state = state * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    word = (word >> 22u) ^ word;
+    return (word >> 8) * (1.f / 16777216.f);
+}
+
+
+// Horizontal square light centred on the given point, emitting towards +y
+// (down, in the scaled Cornell Box)
+AreaLight MakeQuadLight( vec4 centre, float halfSize, vec3 colour ) {
+    AreaLight light;
+    light.corner = centre - vec4(halfSize, 0, halfSize, 0);
+    light.edgeU  = vec4(2 * halfSize, 0, 0, 0);
+    light.edgeV  = vec4(0, 0, 2 * halfSize, 0);
+    light.normal = vec3(0, 1, 0);
+    light.colour = colour;
+    light.area   = 4 * halfSize * halfSize;
+    return light;
+}
+
+vec4 SampleAreaLight( const AreaLight& light, float u, float v ) {
+    return light.corner + u * light.edgeU + v * light.edgeV;
+}
+
+// Sample i of an nx * ny jittered grid over the unit square, shifted
+// toroidally by (offU, offV). A per-pixel shift keeps every pixel stratified
+// while turning the structured error between pixels into fine noise.
+void StratifiedSample( int i, int nx, int ny, float offU, float offV, uint32_t& rng, float& u, float& v ) {
+    u = ((i % nx) + NextRandom(rng)) / nx + offU;
+    v = ((i / nx) + NextRandom(rng)) / ny + offV;
+    if (u >= 1.f) u -= 1.f;
+    if (v >= 1.f) v -= 1.f;
+}
+
+
+float LightPower( const Light& light ) {
+    return light.colour.x + light.colour.y + light.colour.z;
+}
+
+int BuildLightNode( LightTree& tree, const std::vector<Light>& light_points, int begin, int end ) {
+    int index = tree.nodes.size();
+    tree.nodes.push_back(LightNode());
+
+    vec3 lo = vec3(std::numeric_limits<float>::max());
+    vec3 hi = -lo;
+    float power = 0.f;
+    for (int i = begin; i < end; i++) {
+        const Light& l = light_points[tree.order[i]];
+        vec3 p = vec3(l.position.x, l.position.y, l.position.z);
+        lo = glm::min(lo, p);
+        hi = glm::max(hi, p);
+        power += LightPower(l);
+    }
+
+    LightNode node;
+    node.lo = lo;
+    node.hi = hi;
+    node.power = power;
+    node.left = node.right = node.light = -1;
+
+    if (end - begin == 1) {
+        node.light = tree.order[begin];
+    } else {
+        // Median split along the widest axis of the light positions
+        vec3 extent = hi - lo;
+        int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+        int mid = (begin + end) / 2;
+        std::nth_element(tree.order.begin() + begin, tree.order.begin() + mid, tree.order.begin() + end,
+                         [&](int a, int b) { return light_points[a].position[axis] < light_points[b].position[axis]; });
+        node.left  = BuildLightNode(tree, light_points, begin, mid);
+        node.right = BuildLightNode(tree, light_points, mid, end);
+    }
+    tree.nodes[index] = node;
+    return index;
+}
+
+void BuildLightTree( LightTree& tree, const std::vector<Light>& light_points ) {
+    tree.nodes.clear();
+    tree.order.resize(light_points.size());
+    for (uint32_t i = 0; i < light_points.size(); i++) tree.order[i] = i;
+    if (light_points.empty()) return;
+    tree.nodes.reserve(2 * light_points.size());
+    BuildLightNode(tree, light_points, 0, light_points.size());
+}
+
+
+// Estimated contribution of a node to a shading point: power over squared
+// distance, scaled by the best cosine any corner of the node subtends with the
+// surface normal. A node entirely behind the surface gets zero.
+float LightImportance( const LightNode& node, vec3 p, vec3 n ) {
+    vec3 centre = 0.5f * (node.lo + node.hi);
+    vec3 diag   = node.hi - node.lo;
+    vec3 d      = centre - p;
+    float dist2 = glm::max(glm::dot(d, d), 0.25f * glm::dot(diag, diag));
+    dist2 = glm::max(dist2, 1e-4f);
+
+    bool inside = p.x >= node.lo.x && p.x <= node.hi.x &&
+                  p.y >= node.lo.y && p.y <= node.hi.y &&
+                  p.z >= node.lo.z && p.z <= node.hi.z;
+    float cosBound = inside ? 1.f : 0.f;
+    for (int c = 0; c < 8 && cosBound < 1.f; c++) {
+        vec3 corner = vec3((c & 1) ? node.hi.x : node.lo.x,
+                           (c & 2) ? node.hi.y : node.lo.y,
+                           (c & 4) ? node.hi.z : node.lo.z);
+        vec3 toCorner = corner - p;
+        float len = glm::length(toCorner);
+        if (len > 0.f) cosBound = glm::max(cosBound, glm::dot(n, toCorner) / len);
+    }
+    return node.power * cosBound / dist2;
+}
+
+// Walk from the root choosing a child in proportion to its importance, reusing
+// u at every level. Returns the chosen light and the probability of picking
+// it, or -1 if every light is behind the surface.
+int SampleLightTree( const LightTree& tree, vec3 p, vec3 n, float u, float& pdf ) {
+    pdf = 1.f;
+    if (tree.nodes.empty()) return -1;
+
+    int index = 0;
+    while (tree.nodes[index].light < 0) {
+        const LightNode& node = tree.nodes[index];
+        float wl = LightImportance(tree.nodes[node.left],  p, n);
+        float wr = LightImportance(tree.nodes[node.right], p, n);
+        if (wl + wr <= 0.f) return -1;
+
+        float pl = wl / (wl + wr);
+        if (u < pl) {
+            u /= pl;
+            pdf *= pl;
+            index = node.left;
+        } else {
+            u = (u - pl) / (1.f - pl);
+            pdf *= 1.f - pl;
+            index = node.right;
+        }
+        u = glm::min(u, 0.99999994f);
+    }
+    return tree.nodes[index].light;
+}
+
+#endif
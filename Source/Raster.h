@@ -0,0 +1,243 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+// Rasterized primary visibility. Every primitive is binned to the screen
+// tiles its projection covers, then each tile is rasterized on its own thread
+// into a visibility buffer holding the closest object index and depth of
+// every pixel sample.
+//
+// Coverage is decided conservatively (projected bounds, then edge functions
+// with a small margin) and depth comes from the primitive's own intersect
+// test, applied in object order with the same strict depth comparison as
+// ClosestIntersection. A sample therefore ends up with exactly the hit the
+// ray tracer would have found; the raster pass only skips the primitives
+// that provably cannot cover it.
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include <math.h>
+#include "TestModelH.h"
+
+using glm::vec3;
+using glm::vec4;
+using glm::mat4;
+
+#define RASTER_TILE        32
+#define RASTER_NEAR        1e-4f   // Primitives closer than this fall back to whole-screen coverage
+#define RASTER_EDGE_MARGIN 0.05f   // Pixels of slack before an edge function rejects a sample
+
+struct VisSample {
+    int   objectIndex;  // -1 if nothing is hit
+    float depth;
+};
+
+// Screen-space footprint of one primitive for the current camera
+struct RasterPrimitive {
+    int   x0, y0, x1, y1;   // inclusive pixel bounds
+    bool  useEdges;
+    float edge[3][3];       // a*px + b*py + c >= -margin inside, for each edge
+};
+
+struct VisibilityBuffer {
+    int width, height, samples;
+    int tilesX, tilesY;
+    std::vector<VisSample> data;
+    std::vector<RasterPrimitive> prims;
+    std::vector< std::vector<int> > bins;
+
+    const VisSample& at(int x, int y, int i) const { return data[(y * width + x) * samples + i]; }
+};
+
+void RasterizePrimary( VisibilityBuffer& vb,
+                       const std::vector<Object*>& objects,
+                       const mat4& R,
+                       float F,
+                       const vec4& origin,
+                       int width,
+                       int height,
+                       const float* delta_x,
+                       const float* delta_y,
+                       int samples );
+
+
+// Project a world-space point into the screen coordinates used to build
+// primary rays, px = x - width/2 + dx. Returns false if it is not in front.
+bool ProjectPoint( const mat4& R, float F, const vec4& origin, vec3 p, float& px, float& py ) {
+    vec3 d = p - vec3(origin.x, origin.y, origin.z);
+    float X = glm::dot(vec3(R[0].x, R[0].y, R[0].z), d);
+    float Y = glm::dot(vec3(R[1].x, R[1].y, R[1].z), d);
+    float Z = glm::dot(vec3(R[2].x, R[2].y, R[2].z), d);
+    if (Z <= RASTER_NEAR) return false;
+    px = F * X / Z;
+    py = F * Y / Z;
+    return true;
+}
+
+void SetupRasterPrimitive( RasterPrimitive& prim,
+                           const Object* object,
+                           const mat4& R,
+                           float F,
+                           const vec4& origin,
+                           int width,
+                           int height ) {
+
+    prim.x0 = 0;
+    prim.y0 = 0;
+    prim.x1 = width - 1;
+    prim.y1 = height - 1;
+    prim.useEdges = false;
+
+    // Triangles are bounded by their vertices, anything else by the corners
+    // of its bounding box
+    vec3 points[8];
+    int nPoints;
+    vec4 v[3];
+    if (object->vertices(v[0], v[1], v[2])) {
+        for (int k = 0; k < 3; k++) points[k] = vec3(v[k].x, v[k].y, v[k].z);
+        nPoints = 3;
+    } else {
+        vec3 lo, hi;
+        object->bounds(lo, hi);
+        for (int c = 0; c < 8; c++) {
+            points[c] = vec3((c & 1) ? hi.x : lo.x, (c & 2) ? hi.y : lo.y, (c & 4) ? hi.z : lo.z);
+        }
+        nPoints = 8;
+    }
+
+    float px[8], py[8];
+    for (int k = 0; k < nPoints; k++) {
+        if (!ProjectPoint(R, F, origin, points[k], px[k], py[k])) return;   // Crosses the camera plane
+    }
+
+    float minX = px[0], maxX = px[0], minY = py[0], maxY = py[0];
+    for (int k = 1; k < nPoints; k++) {
+        minX = std::min(minX, px[k]);
+        maxX = std::max(maxX, px[k]);
+        minY = std::min(minY, py[k]);
+        maxY = std::max(maxY, py[k]);
+    }
+
+    // Pixel x renders px = x - width/2 + dx with |dx| <= 0.25, so pad by a pixel
+    prim.x0 = std::max(0,          (int)floorf(minX) + width / 2 - 1);
+    prim.x1 = std::min(width - 1,  (int)ceilf(maxX)  + width / 2 + 1);
+    prim.y0 = std::max(0,          (int)floorf(minY) + height / 2 - 1);
+    prim.y1 = std::min(height - 1, (int)ceilf(maxY)  + height / 2 + 1);
+
+    if (nPoints == 3) {
+        float area = (px[1] - px[0]) * (py[2] - py[0]) - (py[1] - py[0]) * (px[2] - px[0]);
+        if (fabsf(area) < 1e-3f) return;    // Edge-on, leave it to the exact test
+        float sign = area > 0 ? 1.f : -1.f;
+        for (int k = 0; k < 3; k++) {
+            int a = k, b = (k + 1) % 3;
+            float ex = px[b] - px[a], ey = py[b] - py[a];
+            float len = sqrtf(ex * ex + ey * ey);
+            prim.edge[k][0] = -sign * ey / len;
+            prim.edge[k][1] =  sign * ex / len;
+            prim.edge[k][2] = -(prim.edge[k][0] * px[a] + prim.edge[k][1] * py[a]);
+        }
+        prim.useEdges = true;
+    }
+}
+
+void RasterizeTile( VisibilityBuffer& vb,
+                    int tile,
+                    const std::vector<Object*>& objects,
+                    const mat4& R,
+                    float F,
+                    const vec4& origin,
+                    const float* delta_x,
+                    const float* delta_y ) {
+
+    int tx0 = (tile % vb.tilesX) * RASTER_TILE;
+    int ty0 = (tile / vb.tilesX) * RASTER_TILE;
+    int tx1 = std::min(vb.width,  tx0 + RASTER_TILE) - 1;
+    int ty1 = std::min(vb.height, ty0 + RASTER_TILE) - 1;
+
+    for (int y = ty0; y <= ty1; y++) {
+        for (int x = tx0; x <= tx1; x++) {
+            for (int i = 0; i < vb.samples; i++) {
+                VisSample& s = vb.data[(y * vb.width + x) * vb.samples + i];
+                s.objectIndex = -1;
+                s.depth = std::numeric_limits<float>::max();
+            }
+        }
+    }
+
+    // Bins list primitives in object order, matching ClosestIntersection
+    const std::vector<int>& bin = vb.bins[tile];
+    for (uint32_t b = 0; b < bin.size(); b++) {
+        int index = bin[b];
+        const RasterPrimitive& prim = vb.prims[index];
+        const Object* object = objects[index];
+
+        int x0 = std::max(tx0, prim.x0), x1 = std::min(tx1, prim.x1);
+        int y0 = std::max(ty0, prim.y0), y1 = std::min(ty1, prim.y1);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                for (int i = 0; i < vb.samples; i++) {
+                    // Same expression Draw uses to build the primary ray
+                    vec4 dir = vec4(x - vb.width/2 + delta_x[i], y - vb.height/2 + delta_y[i], F, 1.0);
+
+                    if (prim.useEdges) {
+                        bool outside = false;
+                        for (int k = 0; k < 3; k++) {
+                            float e = prim.edge[k][0] * dir.x + prim.edge[k][1] * dir.y + prim.edge[k][2];
+                            if (e < -RASTER_EDGE_MARGIN) outside = true;
+                        }
+                        if (outside) continue;
+                    }
+
+                    float t;
+                    vec4 position;
+                    if (object->intersect(origin, R * dir, t, position)) {
+                        VisSample& s = vb.data[(y * vb.width + x) * vb.samples + i];
+                        if (t < s.depth) {
+                            s.depth = t;
+                            s.objectIndex = index;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void RasterizePrimary( VisibilityBuffer& vb,
+                       const std::vector<Object*>& objects,
+                       const mat4& R,
+                       float F,
+                       const vec4& origin,
+                       int width,
+                       int height,
+                       const float* delta_x,
+                       const float* delta_y,
+                       int samples ) {
+
+    vb.width   = width;
+    vb.height  = height;
+    vb.samples = samples;
+    vb.tilesX  = (width  + RASTER_TILE - 1) / RASTER_TILE;
+    vb.tilesY  = (height + RASTER_TILE - 1) / RASTER_TILE;
+    vb.data.resize(width * height * samples);
+    vb.prims.resize(objects.size());
+    vb.bins.resize(vb.tilesX * vb.tilesY);
+    for (uint32_t t = 0; t < vb.bins.size(); t++) vb.bins[t].clear();
+
+    for (uint32_t i = 0; i < objects.size(); i++) {
+        RasterPrimitive& prim = vb.prims[i];
+        SetupRasterPrimitive(prim, objects[i], R, F, origin, width, height);
+        if (prim.x0 > prim.x1 || prim.y0 > prim.y1) continue;   // Off screen
+        for (int ty = prim.y0 / RASTER_TILE; ty <= prim.y1 / RASTER_TILE; ty++) {
+            for (int tx = prim.x0 / RASTER_TILE; tx <= prim.x1 / RASTER_TILE; tx++) {
+                vb.bins[ty * vb.tilesX + tx].push_back(i);
+            }
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < vb.tilesX * vb.tilesY; tile++) {
+        RasterizeTile(vb, tile, objects, R, F, origin, delta_x, delta_y);
+    }
+}
+
+#endif
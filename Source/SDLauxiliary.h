@@ -21,6 +21,9 @@ void PutPixelSDL( screen *s, int x, int y, glm::vec3 color );
 void SDL_Renderframe(screen *s);
 void KillSDL(screen* s);
 void SDL_SaveImage(screen *s, const char* filename);
+screen* InitializeOffscreen( int width, int height );
+void KillOffscreen(screen* s);
+uint32_t* AllocateFramebuffer( int width, int height );
 
 void SDL_SaveImage(screen *s, const char* filename)
 {
@@ -46,11 +49,11 @@ void SDL_SaveImage(screen *s, const char* filename)
 					       rmask,gmask,bmask,amask);
   if(SDL_SaveBMP(surf, filename) !=0)
     {
-      std::cout << "Failed to save image: "
+      std::cerr << "Failed to save image: "
 		<< SDL_GetError() << std::endl;
       exit(1);
     }
-  
+  SDL_FreeSurface(surf);
 }
 
 void KillSDL(screen* s)
@@ -74,7 +77,7 @@ screen* InitializeSDL(int width,int height, bool fullscreen)
 {
   if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) !=0)
     {
-      std::cout << "Could not initialise SDL: "
+      std::cerr << "Could not initialise SDL: "
 		<< SDL_GetError() << std::endl;
       exit(1);
     }
@@ -82,8 +85,7 @@ screen* InitializeSDL(int width,int height, bool fullscreen)
   screen *s = new screen;
   s->width = width;
   s->height = height;
-  s->buffer = new uint32_t[width*height];
-  memset(s->buffer, 0, width*height*sizeof(uint32_t));
+  s->buffer = AllocateFramebuffer(width, height);
   
   uint32_t flags = SDL_WINDOW_OPENGL;
   if(fullscreen)
@@ -96,7 +98,7 @@ screen* InitializeSDL(int width,int height, bool fullscreen)
 				      width, height,flags);
   if(s->window == 0)
     {
-      std::cout << "Could not set video mode: "
+      std::cerr << "Could not set video mode: "
 	     << SDL_GetError() << std::endl;
       exit(1);
     }
@@ -105,7 +107,7 @@ screen* InitializeSDL(int width,int height, bool fullscreen)
   s->renderer = SDL_CreateRenderer(s->window, -1, flags);
   if(s->renderer == 0)
     {
-      std::cout << "Could not create renderer: "
+      std::cerr << "Could not create renderer: "
 	     << SDL_GetError() << std::endl;
       exit(1);
     }
@@ -118,7 +120,7 @@ screen* InitializeSDL(int width,int height, bool fullscreen)
 				 s->width,s->height);
   if(s->texture==0)
     {
-      std::cout << "Could not allocate texture: "
+      std::cerr << "Could not allocate texture: "
 	     << SDL_GetError() << std::endl;
       exit(1);
     }
@@ -126,6 +128,39 @@ screen* InitializeSDL(int width,int height, bool fullscreen)
   return s;
 }
 
+// Zero the buffer row by row with the same static schedule Draw renders with,
+// so first touch places each band of rows on the NUMA node of the thread that
+// will write it
+uint32_t* AllocateFramebuffer(int width, int height)
+{
+  uint32_t *buffer = new uint32_t[width*height];
+  #pragma omp parallel for schedule(static)
+  for (int y = 0; y < height; y++)
+    {
+      memset(buffer + y*width, 0, width*sizeof(uint32_t));
+    }
+  return buffer;
+}
+
+// A screen with only a pixel buffer, for rendering without a window
+screen* InitializeOffscreen(int width, int height)
+{
+  screen *s = new screen;
+  s->window = 0;
+  s->renderer = 0;
+  s->texture = 0;
+  s->width = width;
+  s->height = height;
+  s->buffer = AllocateFramebuffer(width, height);
+  return s;
+}
+
+void KillOffscreen(screen* s)
+{
+  delete[] s->buffer;
+  delete s;
+}
+
 bool NoQuitMessageSDL()
 {
   SDL_Event e;
@@ -150,7 +185,7 @@ void PutPixelSDL(screen* s, int x, int y, glm::vec3 colour)
 {
   if(x<0 || x>=s->width || y<0 || y>=s->height)
     {
-      std::cout << "apa" << std::endl;
+      std::cerr << "apa" << std::endl;
       return;
     }
   uint32_t r = uint32_t( glm::clamp( 255*colour.r, 0.f, 255.f ) );
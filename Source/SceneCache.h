@@ -0,0 +1,300 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+// Versioned binary scene cache. The wide BVH, with its packed leaf
+// primitives, is written once, then memory-mapped read-only on later runs;
+// the intersection code reads vertices and nodes straight out of the mapped
+// pages, so several render processes on one node share a single copy.
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "TestModelH.h"
+#include "WideBVH.h"
+
+#define SCENE_CACHE_MAGIC   "RTSCENE"
+#define SCENE_CACHE_VERSION 4
+
+// Section offsets are in bytes from the start of the file. Every section
+// starts on a 64-byte boundary, so mapped BVH nodes stay cache-line aligned.
+struct SceneCacheHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t objectSize;
+    uint32_t objectCount;
+    uint64_t objectOffset;
+    uint64_t accelOffset;
+    uint64_t accelSize;
+    uint64_t fileSize;
+    uint32_t modelVersion;  // TEST_MODEL_VERSION of the scene that was cached
+    uint32_t pad;
+};
+static_assert(sizeof(SceneCacheHeader) == 64, "SceneCacheHeader must keep the object section 64-byte aligned");
+
+// The object section holds the BVH's packed leaf primitives, in leaf order.
+// The acceleration section is this header followed by the WideNode array.
+struct WideBVHSection {
+    uint32_t nodeCount;
+    uint32_t primCount;
+    uint32_t pad[14];
+};
+
+// Zero-copy views onto a mapped PackedObject
+class MappedTriangle : public Object {
+    public:
+        const PackedObject* packed;
+
+        MappedTriangle( const PackedObject* p )
+            : Object(vec3(p->color[0], p->color[1], p->color[2]), (Material_t)p->material),
+              packed(p)
+        {}
+
+        bool intersect(vec4 s, vec4 dir, float &t, vec4 &position) const {
+            return IntersectTriangle(vertex(packed->p0), vertex(packed->p1), vertex(packed->p2),
+                                     s, dir, t, position);
+        }
+
+        vec4 ComputeNormal(vec4 intersect) const {
+            return TriangleNormal(vertex(packed->p0), vertex(packed->p1), vertex(packed->p2));
+        }
+
+        void bounds(vec3 &lo, vec3 &hi) const {
+            TriangleBounds(vertex(packed->p0), vertex(packed->p1), vertex(packed->p2), lo, hi);
+        }
+
+        bool vertices(vec4 &v0, vec4 &v1, vec4 &v2) const {
+            v0 = vertex(packed->p0);
+            v1 = vertex(packed->p1);
+            v2 = vertex(packed->p2);
+            return true;
+        }
+
+        void scale(float L) {}
+
+    private:
+        static vec4 vertex(const float* p) { return vec4(p[0], p[1], p[2], 1.f); }
+};
+
+class MappedSphere : public Object {
+    public:
+        const PackedObject* packed;
+
+        MappedSphere( const PackedObject* p )
+            : Object(vec3(p->color[0], p->color[1], p->color[2]), (Material_t)p->material),
+              packed(p)
+        {}
+
+        bool intersect(vec4 s, vec4 dir, float &t, vec4 &position) const {
+            float r = packed->p1[0];
+            return IntersectSphere(center(), r*r, s, dir, t, position);
+        }
+
+        vec4 ComputeNormal(vec4 intersect) const {
+            return SphereNormal(center(), intersect);
+        }
+
+        void bounds(vec3 &lo, vec3 &hi) const {
+            float r = packed->p1[0];
+            lo = vec3(packed->p0[0] - r, packed->p0[1] - r, packed->p0[2] - r);
+            hi = vec3(packed->p0[0] + r, packed->p0[1] + r, packed->p0[2] + r);
+        }
+
+        void scale(float L) {}
+
+    private:
+        vec4 center() const { return vec4(packed->p0[0], packed->p0[1], packed->p0[2], 1.f); }
+};
+
+// A live mapping and the views that point into it. The views are held in two
+// contiguous arrays so loading costs two allocations, not one per primitive.
+struct SceneCache {
+    void*  base;
+    size_t size;
+    const SceneCacheHeader* header;
+    const PackedObject*     packed;
+    std::vector<MappedTriangle> triangles;
+    std::vector<MappedSphere>   spheres;
+
+    SceneCache() : base(NULL), size(0), header(NULL), packed(NULL) {}
+};
+
+bool WriteSceneCache( const char* path, const WideBVH& bvh );
+bool LoadSceneCache( const char* path, SceneCache& cache, std::vector<Object*>& objects, WideBVH& bvh );
+void UnmapSceneCache( SceneCache& cache );
+bool ValidWideBVH( const WideNode* nodes, uint32_t nodeCount,
+                   const PackedObject* leaves, uint32_t primCount, uint32_t objectCount );
+
+
+// Write to a temporary file and rename it into place, so a process mapping
+// the cache never sees a partially written file.
+bool WriteSceneCache( const char* path, const WideBVH& bvh ) {
+    SceneCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC));
+    header.version      = SCENE_CACHE_VERSION;
+    header.modelVersion = TEST_MODEL_VERSION;
+    header.headerSize   = sizeof(SceneCacheHeader);
+    header.objectSize   = sizeof(PackedObject);
+    header.objectCount  = bvh.primCount;
+    header.objectOffset = sizeof(SceneCacheHeader);
+    header.accelOffset  = header.objectOffset + bvh.primCount * sizeof(PackedObject);
+    header.accelSize    = sizeof(WideBVHSection) + bvh.nodeCount * sizeof(WideNode);
+    header.fileSize     = header.accelOffset + header.accelSize;
+
+    WideBVHSection section;
+    memset(&section, 0, sizeof(section));
+    section.nodeCount = bvh.nodeCount;
+    section.primCount = bvh.primCount;
+
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (f == NULL) {
+        std::cerr << "Scene cache: could not open " << tmp << " for writing" << std::endl;
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    if (ok && bvh.primCount) ok = fwrite(bvh.leaves, sizeof(PackedObject), bvh.primCount, f) == bvh.primCount;
+    if (ok) ok = fwrite(&section, sizeof(section), 1, f) == 1;
+    if (ok && bvh.nodeCount) ok = fwrite(bvh.nodes, sizeof(WideNode), bvh.nodeCount, f) == bvh.nodeCount;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        std::cerr << "Scene cache: failed to write " << path << std::endl;
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// Check every leaf primitive and every link a traversal of the mapped tree
+// can follow. Each object must appear in exactly one leaf slot. Inner links
+// must point forwards, as the builder lays nodes out parent first, which
+// rules out cycles; depth is limited so the traversal stack cannot overflow.
+bool ValidWideBVH( const WideNode* nodes, uint32_t nodeCount,
+                   const PackedObject* leaves, uint32_t primCount, uint32_t objectCount ) {
+    if (primCount != objectCount) return false;
+    if (objectCount > 0 && nodeCount == 0) return false;
+    std::vector<char> seen;
+    seen.assign(objectCount, 0);
+    for (uint32_t i = 0; i < primCount; i++) {
+        const PackedObject& p = leaves[i];
+        if (p.type != PACKED_TRIANGLE && p.type != PACKED_SPHERE) return false;
+        if (p.material > Gloss) return false;
+        if (p.index >= objectCount || seen[p.index]) return false;
+        seen[p.index] = 1;
+    }
+
+    std::vector<int> depth;
+    depth.assign(nodeCount, 0);
+    for (uint32_t n = 0; n < nodeCount; n++) {
+        for (int c = 0; c < 4; c++) {
+            int32_t link = nodes[n].child[c];
+            if (link == WIDE_EMPTY) continue;
+            if (link >= 0) {
+                if ((uint32_t)link <= n || (uint32_t)link >= nodeCount) return false;
+                if (depth[n] + 1 > WIDE_MAX_DEPTH) return false;
+                depth[link] = std::max(depth[link], depth[n] + 1);
+            } else if ((uint64_t)WideLeafStart(link) + WideLeafCount(link) > primCount) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+// Map the cache read-only and fill objects and bvh with views into it. Returns
+// false, leaving both untouched, if the file is missing, from another version
+// or scene, or fails any of the checks below.
+bool LoadSceneCache( const char* path, SceneCache& cache, std::vector<Object*>& objects, WideBVH& bvh ) {
+    cache.base = NULL;
+    cache.size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SceneCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    const SceneCacheHeader* header = (const SceneCacheHeader*)base;
+    bool valid = memcmp(header->magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC)) == 0 &&
+                 header->version    == SCENE_CACHE_VERSION &&
+                 header->modelVersion == TEST_MODEL_VERSION &&
+                 header->headerSize == sizeof(SceneCacheHeader) &&
+                 header->objectSize == sizeof(PackedObject) &&
+                 header->fileSize   == (uint64_t)st.st_size &&
+                 header->objectOffset + (uint64_t)header->objectCount * sizeof(PackedObject) <= header->fileSize &&
+                 header->accelOffset % sizeof(WideNode) == 0 &&
+                 header->accelSize >= sizeof(WideBVHSection) &&
+                 header->accelOffset + header->accelSize <= header->fileSize;
+    const WideBVHSection* section = (const WideBVHSection*)((const char*)base + header->accelOffset);
+    valid = valid && sizeof(WideBVHSection) + (uint64_t)section->nodeCount * sizeof(WideNode) == header->accelSize;
+    const PackedObject* packed = (const PackedObject*)((const char*)base + header->objectOffset);
+    const WideNode*     nodes  = (const WideNode*)((const char*)section + sizeof(WideBVHSection));
+    valid = valid && ValidWideBVH(nodes, section->nodeCount, packed, section->primCount, header->objectCount);
+    if (!valid) {
+        std::cerr << "Scene cache: " << path << " is stale or corrupt, ignoring" << std::endl;
+        munmap(base, st.st_size);
+        return false;
+    }
+
+    cache.base   = base;
+    cache.size   = st.st_size;
+    cache.header = header;
+    cache.packed = packed;
+
+    bvh.ownedNodes.clear();
+    bvh.ownedLeaves.clear();
+    bvh.nodeCount = section->nodeCount;
+    bvh.primCount = section->primCount;
+    bvh.nodes     = nodes;
+    bvh.leaves    = packed;
+
+    uint32_t nTriangles = 0;
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        if (cache.packed[i].type == PACKED_TRIANGLE) nTriangles++;
+    }
+    cache.triangles.clear();
+    cache.spheres.clear();
+    cache.triangles.reserve(nTriangles);
+    cache.spheres.reserve(header->objectCount - nTriangles);
+
+    // Leaves are in BVH order; each view goes back to its object's slot
+    objects.assign(header->objectCount, NULL);
+    for (uint32_t i = 0; i < header->objectCount; i++) {
+        const PackedObject* p = &cache.packed[i];
+        if (p->type == PACKED_TRIANGLE) {
+            cache.triangles.push_back(MappedTriangle(p));
+            objects[p->index] = &cache.triangles.back();
+        } else {    // PACKED_SPHERE
+            cache.spheres.push_back(MappedSphere(p));
+            objects[p->index] = &cache.spheres.back();
+        }
+    }
+    return true;
+}
+
+
+void UnmapSceneCache( SceneCache& cache ) {
+    cache.triangles.clear();
+    cache.spheres.clear();
+    if (cache.base != NULL) munmap(cache.base, cache.size);
+    cache.base = NULL;
+    cache.size = 0;
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+// Camera-path sequences: keyframe loading, frame encoders, and a bounded
+// pipeline that hands finished frames to an I/O thread so encoding and
+// writing frame N overlaps with rendering frame N+1.
+#include <glm/glm.hpp>
+#include <vector>
+#include <deque>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <omp.h>
+#include "SDLauxiliary.h"
+#include "Threading.h"
+
+using glm::vec4;
+
+// One line of a keyframe file: camera x y z, yaw, light x y z
+struct Keyframe {
+    vec4  position;
+    float yaw;
+    vec4  light;
+};
+
+// Writes a frame either to a Y4M stream, or as a numbered BMP
+struct FrameWriter {
+    bool        y4m;
+    FILE*       stream;
+    std::string prefix;
+    int         width, height;
+    bool        headerWritten;
+    std::vector<uint8_t> planes;
+};
+
+// Frames are rendered into a fixed pool of buffers. The renderer blocks when
+// every buffer is waiting to be written, which bounds the memory in flight.
+struct FramePipeline {
+    std::vector<uint32_t*>       buffers;
+    std::vector<int>             free;
+    std::deque<std::pair<int, int> > ready;   // (buffer, frame number)
+    std::mutex                   lock;
+    std::condition_variable      changed;
+    bool                         finished;
+    double                       ioSeconds;
+    FrameWriter*                 writer;
+    std::thread                  io;
+};
+
+bool LoadKeyframes( const char* path, std::vector<Keyframe>& keyframes );
+FILE* DetachStdout();
+void OpenFrameWriter( FrameWriter& writer, const char* out, FILE* stream, int width, int height );
+void WriteFrame( FrameWriter& writer, const uint32_t* buffer, int frame );
+void StartPipeline( FramePipeline& pipeline, FrameWriter& writer, int depth );
+int  AcquireFrameBuffer( FramePipeline& pipeline );
+void SubmitFrameBuffer( FramePipeline& pipeline, int buffer, int frame );
+void FinishPipeline( FramePipeline& pipeline );
+
+
+bool LoadKeyframes( const char* path, std::vector<Keyframe>& keyframes ) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Could not open keyframe file " << path << std::endl;
+        return false;
+    }
+    keyframes.clear();
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream fields(line);
+        Keyframe k;
+        if (!(fields >> k.position.x >> k.position.y >> k.position.z >> k.yaw
+                     >> k.light.x >> k.light.y >> k.light.z)) {
+            std::cerr << path << ":" << lineNumber << ": expected x y z yaw lx ly lz" << std::endl;
+            return false;
+        }
+        k.position.w = 1.0;
+        k.light.w    = 1.0;
+        keyframes.push_back(k);
+    }
+    if (keyframes.empty()) {
+        std::cerr << path << ": no keyframes" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+// Keep the real stdout for frames and send everything else printed to stdout,
+// through printf or std::cout, to stderr instead, so no diagnostic can land in
+// the middle of a Y4M stream
+FILE* DetachStdout() {
+    fflush(stdout);
+    std::cout.flush();
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0) return stdout;
+    FILE* frames = fdopen(fd, "wb");
+    if (!frames) {
+        close(fd);
+        return stdout;
+    }
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    return frames;
+}
+
+
+// "-" streams Y4M (4:4:4) to stream, anything else is a file name prefix
+void OpenFrameWriter( FrameWriter& writer, const char* out, FILE* stream, int width, int height ) {
+    writer.y4m           = std::string(out) == "-";
+    writer.stream        = stream;
+    writer.prefix        = out;
+    writer.width         = width;
+    writer.height        = height;
+    writer.headerWritten = false;
+    if (writer.y4m) writer.planes.resize(3 * width * height);
+}
+
+void WriteFrame( FrameWriter& writer, const uint32_t* buffer, int frame ) {
+    int n = writer.width * writer.height;
+    if (!writer.y4m) {
+        char name[32];
+        snprintf(name, sizeof(name), "%04d.bmp", frame);
+        screen s = {0, 0, 0, writer.height, writer.width, (uint32_t*)buffer};
+        SDL_SaveImage(&s, (writer.prefix + name).c_str());
+        return;
+    }
+
+    if (!writer.headerWritten) {
+        fprintf(writer.stream, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C444\n", writer.width, writer.height);
+        writer.headerWritten = true;
+    }
+    // BT.601 studio-range conversion from the ARGB8888 framebuffer
+    uint8_t* Y = &writer.planes[0];
+    uint8_t* U = Y + n;
+    uint8_t* V = U + n;
+    for (int i = 0; i < n; i++) {
+        int r = (buffer[i] >> 16) & 0xff, g = (buffer[i] >> 8) & 0xff, b = buffer[i] & 0xff;
+        Y[i] = (( 66 * r + 129 * g +  25 * b + 128) >> 8) + 16;
+        U[i] = ((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128;
+        V[i] = ((112 * r -  94 * g -  18 * b + 128) >> 8) + 128;
+    }
+    fputs("FRAME\n", writer.stream);
+    fwrite(Y, 1, 3 * n, writer.stream);
+    fflush(writer.stream);
+}
+
+
+void PipelineWorker( FramePipeline* pipeline ) {
+    // Encode on any free CPU, not on the core --pin gave render thread 0
+    UnpinThread();
+    while (true) {
+        std::pair<int, int> job;
+        {
+            std::unique_lock<std::mutex> guard(pipeline->lock);
+            pipeline->changed.wait(guard, [&] { return !pipeline->ready.empty() || pipeline->finished; });
+            if (pipeline->ready.empty()) return;
+            job = pipeline->ready.front();
+            pipeline->ready.pop_front();
+        }
+
+        double start = omp_get_wtime();
+        WriteFrame(*pipeline->writer, pipeline->buffers[job.first], job.second);
+        double elapsed = omp_get_wtime() - start;
+
+        std::lock_guard<std::mutex> guard(pipeline->lock);
+        pipeline->ioSeconds += elapsed;
+        pipeline->free.push_back(job.first);
+        pipeline->changed.notify_all();
+    }
+}
+
+void StartPipeline( FramePipeline& pipeline, FrameWriter& writer, int depth ) {
+    pipeline.writer    = &writer;
+    pipeline.finished  = false;
+    pipeline.ioSeconds = 0;
+    for (int i = 0; i < depth; i++) {
+        pipeline.buffers.push_back(AllocateFramebuffer(writer.width, writer.height));
+        pipeline.free.push_back(i);
+    }
+    pipeline.io = std::thread(PipelineWorker, &pipeline);
+}
+
+int AcquireFrameBuffer( FramePipeline& pipeline ) {
+    std::unique_lock<std::mutex> guard(pipeline.lock);
+    pipeline.changed.wait(guard, [&] { return !pipeline.free.empty(); });
+    int buffer = pipeline.free.back();
+    pipeline.free.pop_back();
+    return buffer;
+}
+
+void SubmitFrameBuffer( FramePipeline& pipeline, int buffer, int frame ) {
+    std::lock_guard<std::mutex> guard(pipeline.lock);
+    pipeline.ready.push_back(std::make_pair(buffer, frame));
+    pipeline.changed.notify_all();
+}
+
+// Drain every submitted frame, then stop the I/O thread
+void FinishPipeline( FramePipeline& pipeline ) {
+    {
+        std::lock_guard<std::mutex> guard(pipeline.lock);
+        pipeline.finished = true;
+        pipeline.changed.notify_all();
+    }
+    pipeline.io.join();
+    for (uint32_t i = 0; i < pipeline.buffers.size(); i++) delete[] pipeline.buffers[i];
+    pipeline.buffers.clear();
+    pipeline.free.clear();
+}
+
+#endif
@@ -23,9 +23,127 @@ class Object {
 							   vec4 &position) const = 0;
 		virtual void scale(float L) = 0;
 		virtual vec4 ComputeNormal(vec4 position) const = 0;
+		virtual void bounds(vec3 &lo, vec3 &hi) const = 0;
+		// Triangles return their vertices, so they can be rasterized
+		virtual bool vertices(vec4 &v0, vec4 &v1, vec4 &v2) const { return false; }
 };
 
 
+// Ray/primitive tests shared by the heap-built objects below and the
+// memory-mapped views in SceneCache.h, so both hit exactly the same points.
+inline bool IntersectTriangle(const vec4 &v0,
+							  const vec4 &v1,
+							  const vec4 &v2,
+							  vec4 s,
+							  vec4 dir,
+							  float &t,
+							  vec4 &position) {
+
+	vec3 e1 = vec3(v1.x - v0.x, v1.y - v0.y, v1.z - v0.z);
+	vec3 e2 = vec3(v2.x - v0.x, v2.y - v0.y, v2.z - v0.z);
+	vec3 b  = vec3(s.x  - v0.x, s.y  - v0.y, s.z  - v0.z);
+	vec3 d  = vec3(dir.x, dir.y, dir.z);
+
+	mat3 A(-d, e1, e2);
+	vec3 x = vec3(-1, -1, -1);
+
+	float detA = glm::determinant(A);
+	float det1 = glm::determinant(mat3(b, e1, e2));
+	t = det1/detA;
+	if (t >= 0) {
+		float det2 = glm::determinant(mat3(-d, b , e2));
+		float det3 = glm::determinant(mat3(-d, e1, b ));
+		float u = det2/detA;
+		float v = det3/detA;
+
+		x = vec3(t, u, v);
+	}
+
+	// Check the inequalities that satisfy valid intersection
+	bool valid = (x[0] >= 0) &&
+	(x[1] >= 0) &&
+	(x[2] >= 0) &&
+	((x[1] + x[2]) <= 1);
+	bool found = false;
+	if (valid) {
+		found = true;
+		position = v0 + (x[1] * vec4(e1.x,e1.y,e1.z, 0)) + (x[2] * vec4(e2.x,e2.y,e2.z, 0));
+	}
+	return found;
+}
+
+inline vec4 TriangleNormal(const vec4 &v0, const vec4 &v1, const vec4 &v2) {
+	vec3 e1 = vec3(v1.x-v0.x,v1.y-v0.y,v1.z-v0.z);
+	vec3 e2 = vec3(v2.x-v0.x,v2.y-v0.y,v2.z-v0.z);
+	vec3 normal3 = glm::normalize( glm::cross( e2, e1 ) );
+	vec4 normal;
+	normal.x = normal3.x;
+	normal.y = normal3.y;
+	normal.z = normal3.z;
+	normal.w = 1.0;
+	return normal;
+}
+
+inline void TriangleBounds(const vec4 &v0, const vec4 &v1, const vec4 &v2, vec3 &lo, vec3 &hi) {
+	lo = glm::min(glm::min(vec3(v0.x, v0.y, v0.z), vec3(v1.x, v1.y, v1.z)), vec3(v2.x, v2.y, v2.z));
+	hi = glm::max(glm::max(vec3(v0.x, v0.y, v0.z), vec3(v1.x, v1.y, v1.z)), vec3(v2.x, v2.y, v2.z));
+}
+
+inline bool SolveQuadratic(const float &a,
+						   const float &b,
+						   const float &c,
+						   float &x0,
+						   float &x1) {
+
+	float discr = b * b - 4 * a * c;
+	if (discr < 0) return false;
+	else if (discr == 0) x0 = x1 = - 0.5 * b / a;
+	else {
+		float q = (b > 0) ? -0.5 * (b + sqrt(discr)) : -0.5 * (b - sqrt(discr));
+		x0 = q / a;
+		x1 = c / q;
+	}
+	return true;
+}
+
+inline bool IntersectSphere(const vec4 &center,
+							float r2,
+							vec4 s,
+							vec4 dir,
+							float &t,
+							vec4 &position) {
+
+	float t0, t1;
+	vec3 s3 	 = vec3(s.x, s.y, s.z);
+	vec3 center3 = vec3(center.x, center.y, center.z);
+	vec3 dir3 	 = vec3(dir.x, dir.y, dir.z);
+	vec3 L 		 = s3 - center3;
+
+	float a = glm::dot(dir3, dir3),
+		  b = 2 * glm::dot(dir3, L),
+		  c = glm::dot(L, L) - r2;
+
+	if (!SolveQuadratic(a, b, c, t0, t1)) return false;
+	if (t0 > t1) std::swap(t0, t1);
+	if (t0 < 0) {
+		t0 = t1;
+		if (t0 < 0) return false;
+	}
+	t = t0;
+	vec3 position3 = s3 + (dir3 * t);
+	position = vec4(position3.x, position3.y, position3.z, 1.f);
+	return true;
+}
+
+inline vec4 SphereNormal(const vec4 &center, vec4 intersect) {
+	vec4 normal = intersect - center;
+	vec3 normal3 = vec3(normal.x, normal.y, normal.z);
+	normal3 = glm::normalize(normal3);
+	normal = vec4(normal3.x, normal3.y, normal3.z, 1.f);
+	return normal;
+}
+
+
 // Used to describe a triangular surface:
 class Triangle : public Object
 {
@@ -44,51 +162,23 @@ class Triangle : public Object
 					   vec4 dir,
 					   float &t,
 					   vec4 &position) const {
-
-			vec3 e1 = vec3(v1.x - v0.x, v1.y - v0.y, v1.z - v0.z);
-	        vec3 e2 = vec3(v2.x - v0.x, v2.y - v0.y, v2.z - v0.z);
-	        vec3 b  = vec3(s.x  - v0.x, s.y  - v0.y, s.z  - v0.z);
-	        vec3 d  = vec3(dir.x, dir.y, dir.z);
-
-	        mat3 A(-d, e1, e2);
-	        vec3 x = vec3(-1, -1, -1);
-
-			float detA = glm::determinant(A);
-			float det1 = glm::determinant(mat3(b, e1, e2));
-			t = det1/detA;
-			if (t >= 0) {
-				float det2 = glm::determinant(mat3(-d, b , e2));
-				float det3 = glm::determinant(mat3(-d, e1, b ));
-				float u = det2/detA;
-				float v = det3/detA;
-
-				x = vec3(t, u, v);
-			}
-
-	        // Check the inequalities that satisfy valid intersection
-	        bool valid = (x[0] >= 0) &&
-	        (x[1] >= 0) &&
-	        (x[2] >= 0) &&
-	        ((x[1] + x[2]) <= 1);
-			bool found = false;
-	        if (valid) {
-	            found = true;
-                position = v0 + (x[1] * vec4(e1.x,e1.y,e1.z, 0)) + (x[2] * vec4(e2.x,e2.y,e2.z, 0));
-	        }
-			return found;
+			return IntersectTriangle(v0, v1, v2, s, dir, t, position);
 	    }
 
 
 		vec4 ComputeNormal(vec4 intersect) const {
-			vec3 e1 = vec3(v1.x-v0.x,v1.y-v0.y,v1.z-v0.z);
-			vec3 e2 = vec3(v2.x-v0.x,v2.y-v0.y,v2.z-v0.z);
-			vec3 normal3 = glm::normalize( glm::cross( e2, e1 ) );
-			vec4 normal;
-			normal.x = normal3.x;
-			normal.y = normal3.y;
-			normal.z = normal3.z;
-			normal.w = 1.0;
-			return normal;
+			return TriangleNormal(v0, v1, v2);
+		}
+
+		void bounds(vec3 &lo, vec3 &hi) const {
+			TriangleBounds(v0, v1, v2, lo, hi);
+		}
+
+		bool vertices(vec4 &a, vec4 &b, vec4 &c) const {
+			a = v0;
+			b = v1;
+			c = v2;
+			return true;
 		}
 
 		void scale(float L) {
@@ -123,70 +213,31 @@ class Sphere : public Object {
 			: Object(color, material), r(r), r2(r*r), center(c)
 			{}
 
-		bool SolveQuadratic(const float &a,
-							const float &b,
-							const float &c,
-							float &x0,
-							float &x1) const{
-
-		    float discr = b * b - 4 * a * c;
-		    if (discr < 0) return false;
-		    else if (discr == 0) x0 = x1 = - 0.5 * b / a;
-		    else {
-		        float q = (b > 0) ? -0.5 * (b + sqrt(discr)) : -0.5 * (b - sqrt(discr));
-		        x0 = q / a;
-		        x1 = c / q;
-		    }
-		    return true;
-		}
-
-		vec4 v3to4(vec3 v3) const {
-			return vec4(v3.x, v3.y, v3.z, 1.f);
-		}
-		vec3 v4to3(vec4 v4) const {
-			return vec3(v4.x, v4.y, v4.z);
-		}
-
 		bool intersect(vec4 s,
 					   vec4 dir,
 					   float &t,
 					   vec4 &position) const {
-
-			float t0, t1;
-			vec3 s3 	 = this->v4to3(s);
-			vec3 center3 = this->v4to3(center);
-			vec3 dir3 	 = this->v4to3(dir);
-			vec3 L 		 = s3 - center3;
-
-			float a = glm::dot(dir3, dir3),
-				  b = 2 * glm::dot(dir3, L) - r2,
-				  c = glm::dot(L, L) - r2;
-
-			if (!this->SolveQuadratic(a, b, c, t0, t1)) return false;
-			if (t0 > t1) std::swap(t0, t1);
-			if (t0 < 0) {
-				t0 = t1;
-				if (t0 < 0) return false;
-			}
-			t = t0;
-			// vec3 position3 = s3 + (dir3 * t);
-			position = this->v3to4(s3 + (dir3 * t));
-			return true;
+			return IntersectSphere(center, r2, s, dir, t, position);
 		}
 
 
 		vec4 ComputeNormal( vec4 intersect) const{
-	        vec4 normal = intersect - center;
-	        vec3 normal3 = vec3(normal.x, normal.y, normal.z);
-	        normal3 = glm::normalize(normal3);
-	        normal = vec4(normal3.x, normal3.y, normal3.z, 1.f);
-	        return normal;
+	        return SphereNormal(center, intersect);
 	    }
 
+		void bounds(vec3 &lo, vec3 &hi) const {
+			lo = vec3(center.x - r, center.y - r, center.z - r);
+			hi = vec3(center.x + r, center.y + r, center.z + r);
+		}
+
 		void scale(float L){}
 };
 
 
+// Recorded in scene caches; bump whenever LoadTestModel's output changes, so
+// caches of the old scene are rebuilt instead of served
+#define TEST_MODEL_VERSION 1
+
 // Loads the Cornell Box. It is scaled to fill the volume:
 // -1 <= x <= +1
 // -1 <= y <= +1
@@ -0,0 +1,76 @@
+#ifndef THREADING_H
+#define THREADING_H
+
+// Thread count and core pinning for the OpenMP render loop
+#include <vector>
+#include <string>
+#include <iostream>
+#include <sched.h>
+#include <pthread.h>
+#include <omp.h>
+
+typedef enum {PIN_NONE, PIN_COMPACT, PIN_SPREAD} PinPolicy_t;
+
+PinPolicy_t ParsePinPolicy( const std::string& name );
+void ConfigureThreads( int nThreads, PinPolicy_t policy );
+void UnpinThread();
+
+
+PinPolicy_t ParsePinPolicy( const std::string& name ) {
+    if (name == "compact") return PIN_COMPACT;
+    if (name == "spread")  return PIN_SPREAD;
+    if (name != "none") std::cerr << "Unknown pinning policy '" << name << "', not pinning" << std::endl;
+    return PIN_NONE;
+}
+
+// CPUs the process may run on, captured before any thread is pinned
+const std::vector<int>& AllowedCpus() {
+    static std::vector<int> cpus;
+    if (cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int i = 0; i < CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &set)) cpus.push_back(i);
+            }
+        }
+    }
+    return cpus;
+}
+
+// Set the team size (0 keeps the OpenMP default) and pin each thread of the
+// team. Compact packs threads onto consecutive CPUs, filling one socket
+// first; spread spaces them evenly over every allowed CPU, so both sockets
+// share the work. The OpenMP runtime reuses its threads between parallel
+// regions of the same size, so the pinning holds for later frames.
+void ConfigureThreads( int nThreads, PinPolicy_t policy ) {
+    const std::vector<int>& cpus = AllowedCpus();
+    if (nThreads > 0) omp_set_num_threads(nThreads);
+    if (policy == PIN_NONE || cpus.empty()) return;
+
+    #pragma omp parallel
+    {
+        int tid  = omp_get_thread_num();
+        int team = omp_get_num_threads();
+        int slot = (policy == PIN_COMPACT) ? tid % cpus.size()
+                                           : (long)tid * cpus.size() / team;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[slot], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+}
+
+// Let the calling thread run on every allowed CPU again. A thread started
+// after ConfigureThreads inherits the master thread's pinning, so helper
+// threads call this to avoid sharing a core with render thread 0.
+void UnpinThread() {
+    const std::vector<int>& cpus = AllowedCpus();
+    if (cpus.empty()) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++) CPU_SET(cpus[i], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+#endif
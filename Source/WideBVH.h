@@ -0,0 +1,509 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+// Compressed 4-wide BVH. Each node is one 64-byte cache line: the parent's
+// bounds as an origin and per-axis step, the four child boxes quantized to 8
+// bits against them, and the four child links. A ray is tested against all
+// four children at once with SSE.
+//
+// Quantized boxes are rounded outwards and every box is padded slightly, so
+// traversal never culls a primitive the linear loop would hit. Hits are
+// resolved with the same closest-then-lowest-index rule as the linear loop,
+// so the chosen primitive and distance match it exactly.
+//
+// Leaf primitives are stored packed, one cache line each, in leaf order, so
+// testing a leaf reads consecutive lines and calls IntersectTriangle or
+// IntersectSphere directly, without going through Object pointers.
+//
+// For comparison the same tree can be expanded to float child boxes, two
+// cache lines per node, and traversed by the same code.
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "TestModelH.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using glm::vec3;
+using glm::vec4;
+
+enum { PACKED_TRIANGLE = 0, PACKED_SPHERE = 1 };
+
+// One primitive per cache line. Triangles use p0..p2 as vertices, spheres use
+// p0 as the centre and p1[0] as the radius.
+struct PackedObject {
+    float    p0[3];
+    float    p1[3];
+    float    p2[3];
+    float    color[3];
+    uint32_t type;
+    uint32_t material;
+    uint32_t index;         // Position in the scene's object list
+    uint32_t pad;
+};
+static_assert(sizeof(PackedObject) == 64, "PackedObject must fill exactly one cache line");
+
+#define WIDE_LEAF_SIZE 4
+#define WIDE_EMPTY     INT32_MIN   // Unused child slot
+#define WIDE_STACK     64
+#define WIDE_MAX_DEPTH ((WIDE_STACK - 4) / 3)   // Deepest tree the stack can always hold
+
+struct alignas(64) WideNode {
+    float   origin[3];
+    float   step[3];        // Parent extent / 255 per axis
+    uint8_t qlo[3][4];      // Child boxes, per axis then per child
+    uint8_t qhi[3][4];
+    int32_t child[4];       // >= 0 inner node, WIDE_EMPTY unused, otherwise a leaf (see WideLeaf)
+};
+
+// The same node with exact float child boxes. 112 bytes, padded to two lines.
+struct alignas(64) FullWideNode {
+    float   lo[3][4];       // Child boxes, per axis then per child
+    float   hi[3][4];
+    int32_t child[4];
+};
+
+// A leaf packs its first primitive and count into a negative child link
+inline int32_t WideLeaf( uint32_t start, uint32_t count ) { return -1 - (int32_t)((start << 3) | (count - 1)); }
+inline uint32_t WideLeafStart( int32_t link ) { return (uint32_t)(-1 - link) >> 3; }
+inline uint32_t WideLeafCount( int32_t link ) { return ((uint32_t)(-1 - link) & 7) + 1; }
+
+// Nodes and leaf primitives either live in the owned vectors or point
+// straight into a memory-mapped scene cache
+struct WideBVH {
+    const WideNode*     nodes;
+    const PackedObject* leaves;     // Primitives in leaf order
+    uint32_t nodeCount;
+    uint32_t primCount;
+    std::vector<WideNode>     ownedNodes;
+    std::vector<PackedObject> ownedLeaves;
+
+    WideBVH() : nodes(NULL), leaves(NULL), nodeCount(0), primCount(0) {}
+};
+
+// Float-box copy of a WideBVH, sharing its leaf primitives
+struct FullWideBVH {
+    std::vector<FullWideNode> nodes;
+    const PackedObject* leaves;
+    uint32_t primCount;
+
+    FullWideBVH() : leaves(NULL), primCount(0) {}
+};
+
+struct WideHit {
+    int   objectIndex;
+    float distance;
+    vec4  position;
+    int   improvements;
+    int   tests;        // Primitive intersection tests made
+};
+
+bool PackObject( const Object* object, PackedObject& out );
+bool BuildWideBVH( WideBVH& bvh, const std::vector<Object*>& objects );
+void BuildFullWideBVH( FullWideBVH& full, const WideBVH& bvh, const std::vector<Object*>& objects );
+bool TraverseWideBVH( const WideBVH& bvh,
+                      const vec4 s,
+                      const vec4 dir,
+                      WideHit& hit );
+bool TraverseWideBVH( const FullWideBVH& bvh,
+                      const vec4 s,
+                      const vec4 dir,
+                      WideHit& hit );
+
+
+bool PackObject( const Object* object, PackedObject& out ) {
+    memset(&out, 0, sizeof(out));
+    out.color[0] = object->color.x;
+    out.color[1] = object->color.y;
+    out.color[2] = object->color.z;
+    out.material = object->material;
+
+    if (const Triangle* tri = dynamic_cast<const Triangle*>(object)) {
+        const vec4* v[3] = {&tri->v0, &tri->v1, &tri->v2};
+        float* p[3] = {out.p0, out.p1, out.p2};
+        for (int i = 0; i < 3; i++) {
+            p[i][0] = v[i]->x;
+            p[i][1] = v[i]->y;
+            p[i][2] = v[i]->z;
+        }
+        out.type = PACKED_TRIANGLE;
+        return true;
+    }
+    if (const Sphere* sph = dynamic_cast<const Sphere*>(object)) {
+        out.p0[0] = sph->center.x;
+        out.p0[1] = sph->center.y;
+        out.p0[2] = sph->center.z;
+        out.p1[0] = sph->r;
+        out.type = PACKED_SPHERE;
+        return true;
+    }
+    return false;
+}
+
+// The same test the primitive's Object would make, so hits match exactly
+inline bool IntersectPacked( const PackedObject& p, const vec4 s, const vec4 dir, float& t, vec4& position ) {
+    if (p.type == PACKED_SPHERE) {
+        return IntersectSphere(vec4(p.p0[0], p.p0[1], p.p0[2], 1.f), p.p1[0] * p.p1[0], s, dir, t, position);
+    }
+    return IntersectTriangle(vec4(p.p0[0], p.p0[1], p.p0[2], 1.f),
+                             vec4(p.p1[0], p.p1[1], p.p1[2], 1.f),
+                             vec4(p.p2[0], p.p2[1], p.p2[2], 1.f), s, dir, t, position);
+}
+
+
+struct WideBuildPrim {
+    vec3 lo, hi, centroid;
+    uint32_t index;
+};
+
+void WideBounds( const std::vector<WideBuildPrim>& prims, int begin, int end, vec3& lo, vec3& hi ) {
+    lo = vec3(std::numeric_limits<float>::max());
+    hi = -lo;
+    for (int i = begin; i < end; i++) {
+        lo = glm::min(lo, prims[i].lo);
+        hi = glm::max(hi, prims[i].hi);
+    }
+}
+
+// Split [begin, end) at the centroid median of its widest axis
+int WideSplit( std::vector<WideBuildPrim>& prims, int begin, int end ) {
+    vec3 lo = vec3(std::numeric_limits<float>::max()), hi = -lo;
+    for (int i = begin; i < end; i++) {
+        lo = glm::min(lo, prims[i].centroid);
+        hi = glm::max(hi, prims[i].centroid);
+    }
+    vec3 extent = hi - lo;
+    int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+    int mid = (begin + end) / 2;
+    std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+                     [&](const WideBuildPrim& a, const WideBuildPrim& b) { return a.centroid[axis] < b.centroid[axis]; });
+    return mid;
+}
+
+int BuildWideNode( WideBVH& bvh, std::vector<WideBuildPrim>& prims, int begin, int end ) {
+    int index = bvh.ownedNodes.size();
+    bvh.ownedNodes.push_back(WideNode());
+
+    // Two rounds of binary splits give up to four children
+    int ranges[4][2];
+    int nRanges = 0;
+    int mid = WideSplit(prims, begin, end);
+    int halves[2][2] = {{begin, mid}, {mid, end}};
+    for (int h = 0; h < 2; h++) {
+        int b = halves[h][0], e = halves[h][1];
+        if (e - b > WIDE_LEAF_SIZE) {
+            int m = WideSplit(prims, b, e);
+            ranges[nRanges][0] = b; ranges[nRanges++][1] = m;
+            ranges[nRanges][0] = m; ranges[nRanges++][1] = e;
+        } else if (e > b) {
+            ranges[nRanges][0] = b; ranges[nRanges++][1] = e;
+        }
+    }
+
+    WideNode node;
+    memset(&node, 0, sizeof(node));
+    vec3 lo, hi;
+    WideBounds(prims, begin, end, lo, hi);
+    for (int k = 0; k < 3; k++) {
+        // Slightly oversized step so 255 steps always reach the far side
+        node.origin[k] = lo[k];
+        node.step[k]   = (hi[k] - lo[k]) / 255.f * 1.0001f + 1e-7f;
+    }
+
+    for (int c = 0; c < 4; c++) {
+        if (c >= nRanges) {
+            node.child[c] = WIDE_EMPTY;
+            continue;
+        }
+        int b = ranges[c][0], e = ranges[c][1];
+        vec3 clo, chi;
+        WideBounds(prims, b, e, clo, chi);
+        for (int k = 0; k < 3; k++) {
+            // Round outwards, then nudge until the dequantized box, computed
+            // exactly as traversal will, contains the child
+            int ql = std::max(0,   (int)floorf((clo[k] - node.origin[k]) / node.step[k]));
+            int qh = std::min(255, (int)ceilf ((chi[k] - node.origin[k]) / node.step[k]));
+            while (ql > 0   && node.origin[k] + ql * node.step[k] > clo[k]) ql--;
+            while (qh < 255 && node.origin[k] + qh * node.step[k] < chi[k]) qh++;
+            node.qlo[k][c] = ql;
+            node.qhi[k][c] = qh;
+        }
+        if (e - b <= WIDE_LEAF_SIZE) {
+            node.child[c] = WideLeaf(b, e - b);
+        } else {
+            node.child[c] = BuildWideNode(bvh, prims, b, e);
+        }
+    }
+    bvh.ownedNodes[index] = node;
+    return index;
+}
+
+// Bounds of every primitive, padded so rays grazing an edge still enter them
+void WidePrimBounds( const std::vector<Object*>& objects, std::vector<WideBuildPrim>& prims ) {
+    prims.resize(objects.size());
+    float sceneSize = 0;
+    for (uint32_t i = 0; i < objects.size(); i++) {
+        objects[i]->bounds(prims[i].lo, prims[i].hi);
+        prims[i].index = i;
+        sceneSize = std::max(sceneSize, std::max(fabsf(prims[i].lo.x), fabsf(prims[i].hi.x)));
+        sceneSize = std::max(sceneSize, std::max(fabsf(prims[i].lo.y), fabsf(prims[i].hi.y)));
+        sceneSize = std::max(sceneSize, std::max(fabsf(prims[i].lo.z), fabsf(prims[i].hi.z)));
+    }
+    vec3 pad = vec3(1e-5f * sceneSize + 1e-7f);
+    for (uint32_t i = 0; i < prims.size(); i++) {
+        prims[i].lo -= pad;
+        prims[i].hi += pad;
+        prims[i].centroid = 0.5f * (prims[i].lo + prims[i].hi);
+    }
+}
+
+// Returns false, leaving bvh empty, if an object has no packed form
+bool BuildWideBVH( WideBVH& bvh, const std::vector<Object*>& objects ) {
+    std::vector<WideBuildPrim> prims;
+    WidePrimBounds(objects, prims);
+
+    bvh.ownedNodes.clear();
+    bvh.ownedLeaves.clear();
+    bvh.nodes     = NULL;
+    bvh.leaves    = NULL;
+    bvh.nodeCount = bvh.primCount = 0;
+    // The root is always an inner node, even for a handful of primitives
+    if (!prims.empty()) BuildWideNode(bvh, prims, 0, prims.size());
+    bvh.ownedLeaves.resize(prims.size());
+    for (uint32_t i = 0; i < prims.size(); i++) {
+        if (!PackObject(objects[prims[i].index], bvh.ownedLeaves[i])) {
+            bvh.ownedNodes.clear();
+            bvh.ownedLeaves.clear();
+            return false;
+        }
+        bvh.ownedLeaves[i].index = prims[i].index;
+    }
+
+    bvh.nodes     = bvh.ownedNodes.empty()  ? NULL : &bvh.ownedNodes[0];
+    bvh.leaves    = bvh.ownedLeaves.empty() ? NULL : &bvh.ownedLeaves[0];
+    bvh.nodeCount = bvh.ownedNodes.size();
+    bvh.primCount = bvh.ownedLeaves.size();
+    return true;
+}
+
+
+// Fill the float copy of the subtree at link, returning its exact bounds
+void BuildFullWideNode( FullWideBVH& full,
+                        const WideBVH& bvh,
+                        const std::vector<WideBuildPrim>& prims,
+                        int32_t link,
+                        vec3& lo,
+                        vec3& hi ) {
+
+    lo = vec3(std::numeric_limits<float>::max());
+    hi = -lo;
+    if (link < 0) {
+        uint32_t start = WideLeafStart(link), count = WideLeafCount(link);
+        for (uint32_t p = start; p < start + count; p++) {
+            lo = glm::min(lo, prims[bvh.leaves[p].index].lo);
+            hi = glm::max(hi, prims[bvh.leaves[p].index].hi);
+        }
+        return;
+    }
+
+    const WideNode& node = bvh.nodes[link];
+    FullWideNode out;
+    memset(&out, 0, sizeof(out));
+    for (int c = 0; c < 4; c++) {
+        out.child[c] = node.child[c];
+        if (node.child[c] == WIDE_EMPTY) continue;
+        vec3 clo, chi;
+        BuildFullWideNode(full, bvh, prims, node.child[c], clo, chi);
+        for (int k = 0; k < 3; k++) {
+            out.lo[k][c] = clo[k];
+            out.hi[k][c] = chi[k];
+        }
+        lo = glm::min(lo, clo);
+        hi = glm::max(hi, chi);
+    }
+    full.nodes[link] = out;
+}
+
+// Expand bvh to float child boxes. Node indices and leaves stay the same, so
+// both trees visit primitives in the same order.
+void BuildFullWideBVH( FullWideBVH& full, const WideBVH& bvh, const std::vector<Object*>& objects ) {
+    std::vector<WideBuildPrim> prims;
+    WidePrimBounds(objects, prims);
+    full.nodes.assign(bvh.nodeCount, FullWideNode());
+    full.leaves    = bvh.leaves;
+    full.primCount = bvh.primCount;
+    vec3 lo, hi;
+    if (bvh.nodeCount > 0) BuildFullWideNode(full, bvh, prims, 0, lo, hi);
+}
+
+
+// Slab test of a ray against the four child boxes of a node. Writes each
+// child's entry distance and returns a bitmask of those entered before tMax.
+inline int IntersectWideNode( const WideNode& node, const float o[3], const float inv[3], float tMax, float tEntry[4] ) {
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128 tNear = _mm_setzero_ps();
+    __m128 tFar  = _mm_set1_ps(tMax);
+    for (int k = 0; k < 3; k++) {
+        int32_t lo32, hi32;
+        memcpy(&lo32, node.qlo[k], 4);
+        memcpy(&hi32, node.qhi[k], 4);
+        __m128i qlo = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lo32), zero), zero);
+        __m128i qhi = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hi32), zero), zero);
+        __m128 origin = _mm_set1_ps(node.origin[k]);
+        __m128 step   = _mm_set1_ps(node.step[k]);
+        __m128 lo = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(qlo), step));
+        __m128 hi = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(qhi), step));
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(lo, _mm_set1_ps(o[k])), _mm_set1_ps(inv[k]));
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(hi, _mm_set1_ps(o[k])), _mm_set1_ps(inv[k]));
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+        tFar  = _mm_min_ps(tFar,  _mm_max_ps(t0, t1));
+    }
+    _mm_storeu_ps(tEntry, tNear);
+    return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+#else
+    int mask = 0;
+    for (int c = 0; c < 4; c++) {
+        float tNear = 0, tFar = tMax;
+        for (int k = 0; k < 3; k++) {
+            float lo = node.origin[k] + node.qlo[k][c] * node.step[k];
+            float hi = node.origin[k] + node.qhi[k][c] * node.step[k];
+            float t0 = (lo - o[k]) * inv[k];
+            float t1 = (hi - o[k]) * inv[k];
+            tNear = std::max(tNear, std::min(t0, t1));
+            tFar  = std::min(tFar,  std::max(t0, t1));
+        }
+        tEntry[c] = tNear;
+        if (tNear <= tFar) mask |= 1 << c;
+    }
+    return mask;
+#endif
+}
+
+inline int IntersectWideNode( const FullWideNode& node, const float o[3], const float inv[3], float tMax, float tEntry[4] ) {
+#ifdef __SSE2__
+    __m128 tNear = _mm_setzero_ps();
+    __m128 tFar  = _mm_set1_ps(tMax);
+    for (int k = 0; k < 3; k++) {
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.lo[k]), _mm_set1_ps(o[k])), _mm_set1_ps(inv[k]));
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.hi[k]), _mm_set1_ps(o[k])), _mm_set1_ps(inv[k]));
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+        tFar  = _mm_min_ps(tFar,  _mm_max_ps(t0, t1));
+    }
+    _mm_storeu_ps(tEntry, tNear);
+    return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+#else
+    int mask = 0;
+    for (int c = 0; c < 4; c++) {
+        float tNear = 0, tFar = tMax;
+        for (int k = 0; k < 3; k++) {
+            float t0 = (node.lo[k][c] - o[k]) * inv[k];
+            float t1 = (node.hi[k][c] - o[k]) * inv[k];
+            tNear = std::max(tNear, std::min(t0, t1));
+            tFar  = std::min(tFar,  std::max(t0, t1));
+        }
+        tEntry[c] = tNear;
+        if (tNear <= tFar) mask |= 1 << c;
+    }
+    return mask;
+#endif
+}
+
+// Closest hit along the ray, ties going to the lowest object index exactly as
+// in the linear loop. Children are visited nearest first so tMax shrinks fast.
+// Shared by both node layouts.
+template <class Node>
+bool TraverseWideNodes( const Node* nodes,
+                        const PackedObject* leaves,
+                        uint32_t nodeCount,
+                        const vec4 s,
+                        const vec4 dir,
+                        WideHit& hit ) {
+
+    hit.objectIndex  = -1;
+    hit.distance     = std::numeric_limits<float>::max();
+    hit.improvements = 0;
+    hit.tests        = 0;
+    if (nodeCount == 0) return false;
+
+    float o[3]   = {s.x, s.y, s.z};
+    float inv[3];
+    for (int k = 0; k < 3; k++) {
+        float d = dir[k];
+        inv[k] = fabsf(d) > 1e-20f ? 1.f / d : copysignf(1e20f, d);
+    }
+
+    int32_t stack[WIDE_STACK];
+    float   stackT[WIDE_STACK];
+    int top = 0;
+    stack[top] = 0;
+    stackT[top++] = 0;
+
+    while (top > 0) {
+        top--;
+        if (stackT[top] > hit.distance) continue;
+        const Node& node = nodes[stack[top]];
+
+        float tEntry[4];
+        int mask = IntersectWideNode(node, o, inv, hit.distance, tEntry);
+
+        // Push entered children farthest first, so the nearest is popped next
+        int order[4], n = 0;
+        for (int c = 0; c < 4; c++) {
+            if ((mask & (1 << c)) && node.child[c] != WIDE_EMPTY) {
+                int j = n++;
+                while (j > 0 && tEntry[order[j - 1]] < tEntry[c]) {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = c;
+            }
+        }
+
+        for (int j = 0; j < n; j++) {
+            int32_t link = node.child[order[j]];
+            if (link >= 0) {
+                stack[top] = link;
+                stackT[top++] = tEntry[order[j]];
+                continue;
+            }
+            uint32_t start = WideLeafStart(link), count = WideLeafCount(link);
+            for (uint32_t p = start; p < start + count; p++) {
+                int index = leaves[p].index;
+                float t;
+                vec4 position;
+                hit.tests += 1;
+                if (IntersectPacked(leaves[p], s, dir, t, position)) {
+                    if (t < hit.distance || (t == hit.distance && index < hit.objectIndex)) {
+                        hit.improvements += 1;
+                        hit.objectIndex = index;
+                        hit.distance = t;
+                        hit.position = position;
+                    }
+                }
+            }
+        }
+    }
+    return hit.objectIndex >= 0;
+}
+
+bool TraverseWideBVH( const WideBVH& bvh,
+                      const vec4 s,
+                      const vec4 dir,
+                      WideHit& hit ) {
+    return TraverseWideNodes(bvh.nodes, bvh.leaves, bvh.nodeCount, s, dir, hit);
+}
+
+bool TraverseWideBVH( const FullWideBVH& bvh,
+                      const vec4 s,
+                      const vec4 dir,
+                      WideHit& hit ) {
+    return TraverseWideNodes(bvh.nodes.empty() ? NULL : &bvh.nodes[0], bvh.leaves, bvh.nodes.size(), s, dir, hit);
+}
+
+#endif
@@ -3,6 +3,14 @@
 #include <SDL.h>
 #include "SDLauxiliary.h"
 #include "TestModelH.h"
+#include "SceneCache.h"
+#include "Lights.h"
+#include "Threading.h"
+#include "Raster.h"
+#include "Sequence.h"
+#include "Heatmap.h"
+#include "Denoise.h"
+#include "Allocation.h"
 #include <stdint.h>
 #include <limits.h>
 #include <math.h>
@@ -22,6 +30,9 @@ using glm::mat4;
 #define SCREEN_HEIGHT 1300   // 256
 #define FULLSCREEN_MODE false
 #define L_SCATTER 0.08f
+#define L_SPREAD 0.6f
+#define L_ROOM 0.95f         // --lights emitters stay this far inside the walls
+#define MAX_SAMPLES 9        // Anti-aliasing samples per pixel
 
 
 // Structs and global variables
@@ -34,17 +45,19 @@ struct Intersection {
     float colourBleedAmount;
 };
 
+// Per-pixel working state for Draw. Each render thread keeps its own for the
+// life of the program, so the pixel loop never touches the heap.
+struct RenderContext {
+    Intersection intersections[MAX_SAMPLES];
+    bool         founds[MAX_SAMPLES];
+};
+
 struct Camera {
     mat4 R;
     float F;
     vec4 position;
 };
 
-struct Light {
-    vec3 colour;
-    vec4 position;
-};
-
 vec4 light_origin;
 Camera camera;
 int softN    = 1;
@@ -55,6 +68,35 @@ bool mirrorF = false;
 float yaw    = 0.0;
 float rad    = PI / 32.f;
 int LIGHT_SAMPLES = 70;
+int LIGHT_BUDGET  = 0;      // Lights sampled per hit from the light tree, 0 evaluates every light
+int manyLights    = 0;
+LightTree lightTree;
+bool areaF        = false;
+int AREA_SAMPLES  = 8;
+AreaLight areaLight;
+int nThreads      = 0;      // 0 uses the OpenMP default
+PinPolicy_t pinPolicy = PIN_NONE;
+bool rasterF      = false;
+VisibilityBuffer visibility;
+const char* sequencePath = NULL;
+const char* sequenceOut  = "frame_";
+FILE* sequenceStream     = stdout;
+bool wbvhF        = false;
+WideBVH wideBVH;
+bool fullBVHF     = false;  // With wbvhF, traverse the float-box copy instead
+FullWideBVH fullBVH;
+bool heatF        = false;
+HeatmapBuffer heatmap;
+bool denoiseF     = false;
+DenoiseBuffer denoiseBuffer;
+double denoiseMs  = 0;
+const char* sceneCachePath = NULL;
+thread_local RenderContext renderContext;
+
+// Sub-pixel offsets of the primary ray samples, shared by Draw and the raster
+// pass so both always trace the same rays
+const float delta_x[MAX_SAMPLES] = {0, 0,    0.25,  0,   -0.25, 0.1,  0.1, -0.1, -0.1}; // SSAA change in ray X direction
+const float delta_y[MAX_SAMPLES] = {0, 0.25, 0,    -0.25, 0,    0.1, -0.1, -0.1,  0.1}; // SSAA change in ray Y direction
 
 
 /* ----------------------------------------------------------------------------*/
@@ -71,12 +113,52 @@ bool ClosestIntersection( const vec4 s,
                           Intersection& intersection,
                           const int global_lum);
 
+void ColourBleed( const vec4 dir,
+                  const vector<Object*>& objects,
+                  Intersection& intersection,
+                  bool found,
+                  const int global_lum);
+
+bool PrimaryIntersection( int x, int y, int i,
+                          const vec4 dir,
+                          const vector<Object*>& objects,
+                          Intersection& intersection);
+
 vec3 DirectLight( const Intersection& intersection,
                   const vector<Object*>& objects,
-                  const vector<Light>& light_points);
+                  const vector<Light>& light_points,
+                  uint32_t seed);
+
+vec3 LightContribution( const Intersection& intersection,
+                        const vec4 normal,
+                        const Light& light,
+                        const vector<Object*>& objects);
 
 void GenerateLight( vector<Light>& light_points );
 
+void AreaLightReport( const vector<Object*>& objects,
+                      vector<Light>& light_points );
+
+void ScalingReport( const vector<Object*>& objects,
+                    const vector<Light>& light_points );
+
+void RasterReport( const vector<Object*>& objects );
+
+bool RenderSequence( const vector<Object*>& objects );
+
+void BVHReport( const vector<Object*>& objects );
+
+void DenoiseReport( const vector<Object*>& objects,
+                    vector<Light>& light_points );
+
+bool AllocationReport( const vector<Object*>& objects,
+                       const vector<Light>& light_points );
+
+bool LightTreeReport( const vector<Object*>& objects,
+                      const vector<Light>& light_points );
+
+mat4 YawMatrix( float yaw );
+
 vec4 reflekt(const vec4 incident, const vec4 normal);
 
 vec4 refract( const vec4 dir,
@@ -86,6 +168,15 @@ vec4 refract( const vec4 dir,
 
 
 int main( int argc, char* argv[] ) {
+    bool areaReport = false;
+    bool scalingF   = false;
+    bool rasterCheck = false;
+    bool bvhReport  = false;
+    const char* heatmapPrefix = NULL;
+    bool denoiseCheck = false;
+    bool allocCheck = false;
+    bool lightCheck = false;
+
     // Parse runtime flags (Basic, no error/duplicate/confliction checking)
     if (argc > 1) {
         for (int i = 1; i < argc; i++) {
@@ -95,6 +186,29 @@ int main( int argc, char* argv[] ) {
             if (std::string(argv[i]) == "--dark")   darkF   = true;
             if (std::string(argv[i]) == "--mirror") mirrorF = true;
             if (std::string(argv[i]) == "--bleed")  bleed   = true;
+            if (std::string(argv[i]) == "--cache" && i + 1 < argc) sceneCachePath = argv[++i];
+            if (std::string(argv[i]) == "--lights" && i + 1 < argc) manyLights = atoi(argv[++i]);
+            if (std::string(argv[i]) == "--light-budget" && i + 1 < argc) LIGHT_BUDGET = atoi(argv[++i]);
+            if (std::string(argv[i]) == "--light-report") lightCheck = true;
+            if (std::string(argv[i]) == "--area" && i + 1 < argc) {
+                areaF        = true;
+                AREA_SAMPLES = atoi(argv[++i]);
+            }
+            if (std::string(argv[i]) == "--area-report") areaReport = true;
+            if (std::string(argv[i]) == "--threads" && i + 1 < argc) nThreads = atoi(argv[++i]);
+            if (std::string(argv[i]) == "--pin" && i + 1 < argc) pinPolicy = ParsePinPolicy(argv[++i]);
+            if (std::string(argv[i]) == "--scaling") scalingF = true;
+            if (std::string(argv[i]) == "--raster") rasterF = true;
+            if (std::string(argv[i]) == "--raster-check") rasterCheck = true;
+            if (std::string(argv[i]) == "--sequence" && i + 1 < argc) sequencePath = argv[++i];
+            if (std::string(argv[i]) == "--out" && i + 1 < argc) sequenceOut = argv[++i];
+            if (std::string(argv[i]) == "--wbvh") wbvhF = true;
+            if (std::string(argv[i]) == "--wbvh-full") wbvhF = fullBVHF = true;
+            if (std::string(argv[i]) == "--bvh-report") bvhReport = true;
+            if (std::string(argv[i]) == "--heatmap" && i + 1 < argc) heatmapPrefix = argv[++i];
+            if (std::string(argv[i]) == "--denoise") denoiseF = true;
+            if (std::string(argv[i]) == "--denoise-report") denoiseCheck = true;
+            if (std::string(argv[i]) == "--alloc-check") allocCheck = true;
             if (std::string(argv[i]) == "--all-flags") {
                 smthF   = true;
                 darkF   = true;
@@ -105,17 +219,65 @@ int main( int argc, char* argv[] ) {
         }
     }
 
+    // With --out -, stdout carries the Y4M stream and nothing else
+    if (sequencePath && std::string(sequenceOut) == "-") sequenceStream = DetachStdout();
+
+    ConfigureThreads(nThreads, pinPolicy);
+
+    // Map the scene from the binary cache if there is one, otherwise build it
+    // procedurally and write the cache for the next run
     vector<Object*> objects;
-    LoadTestModel(objects);
+    SceneCache sceneCache;
+    if (sceneCachePath == NULL || !LoadSceneCache(sceneCachePath, sceneCache, objects, wideBVH)) {
+        LoadTestModel(objects);
+        if (!BuildWideBVH(wideBVH, objects)) {
+            std::cerr << "Wide BVH: the scene has an object with no packed form" << std::endl;
+            return 1;
+        }
+        if (sceneCachePath != NULL) WriteSceneCache(sceneCachePath, wideBVH);
+    }
+    if (fullBVHF || bvhReport) BuildFullWideBVH(fullBVH, wideBVH, objects);
     camera.F        = SCREEN_WIDTH;
     camera.position = vec4( 0.0, 0.0, -3.0, 1.0);
+    camera.R        = mat4(1.0f);   // A default-constructed mat4 is not identity in every GLM version
 
     if (!smthF) { LIGHT_SAMPLES = 1; }
+    if (manyLights > 0) {
+        LIGHT_SAMPLES = manyLights;
+        if (LIGHT_BUDGET == 0) LIGHT_BUDGET = 8;
+    }
+    // Denoising reconstructs the full soft light from a few shadow rays per
+    // pixel, sampled from the light tree
+    if ((denoiseF || denoiseCheck) && smthF && LIGHT_BUDGET == 0) LIGHT_BUDGET = 8;
     // light_origin = vec4(0, -0.5, -0.7, 1.0);
     light_origin = vec4(0.8, 0.4, -0.7, 1.0);
     vector<Light> light_points;
     GenerateLight(light_points);
 
+    if (areaReport || scalingF || rasterCheck || sequencePath || bvhReport || heatmapPrefix || denoiseCheck || allocCheck || lightCheck) {
+        int status = 0;
+        if (allocCheck && !AllocationReport(objects, light_points)) status = 1;
+        if (lightCheck && !LightTreeReport(objects, light_points))  status = 1;
+        if (areaReport)   AreaLightReport(objects, light_points);
+        if (bvhReport)    BVHReport(objects);
+        if (denoiseCheck) DenoiseReport(objects, light_points);
+        if (scalingF)     ScalingReport(objects, light_points);
+        if (rasterCheck)  RasterReport(objects);
+        if (sequencePath && !RenderSequence(objects)) status = 1;
+        if (heatmapPrefix) {
+            // One frame with per-pixel cost recording
+            screen* image = InitializeOffscreen(SCREEN_WIDTH, SCREEN_HEIGHT);
+            ResetHeatmap(heatmap, SCREEN_WIDTH, SCREEN_HEIGHT);
+            heatF = true;
+            Draw(image, objects, light_points);
+            heatF = false;
+            WriteHeatmap(heatmap, heatmapPrefix);
+            KillOffscreen(image);
+        }
+        UnmapSceneCache(sceneCache);
+        return status;
+    }
+
     screen *screen = InitializeSDL( SCREEN_WIDTH, SCREEN_HEIGHT, FULLSCREEN_MODE );
     while( NoQuitMessageSDL() ) {
         Update(light_points);
@@ -125,61 +287,128 @@ int main( int argc, char* argv[] ) {
 
     SDL_SaveImage( screen, "screenshot.bmp" );
     KillSDL(screen);
+    UnmapSceneCache(sceneCache);
     return 0;
 }
 
 
-// Generate a random set of light points around a given origin
+// Generate a random set of light points around a given origin. With --lights
+// they are distinct emitters of varying colour spread through the room,
+// otherwise they jitter a single soft light.
 void GenerateLight( vector<Light>& light_points ) {
     light_points.clear();
     vec3 colour = 14.f * vec3(1, 1, 1);
     Light firstLight = {.colour = colour, .position = light_origin};
     light_points.push_back(firstLight);
+    float scatter = manyLights > 0 ? L_SPREAD : L_SCATTER;
     for (int i = 1; i < LIGHT_SAMPLES; i++) {
-        float x = glm::linearRand(-L_SCATTER, L_SCATTER) + light_origin.x;
-        float y = glm::linearRand(-L_SCATTER, L_SCATTER) + light_origin.y;
-        float z = glm::linearRand(-L_SCATTER, L_SCATTER) + light_origin.z;
-        vec4 pos = vec4(x, y, z, 1.0);
+        // The wide --lights spread is cut to the room's interior, so no
+        // emitter sits behind a wall or in front of the open box
+        vec4 pos = vec4(0, 0, 0, 1.0);
+        for (int k = 0; k < 3; k++) {
+            float lo = light_origin[k] - scatter, hi = light_origin[k] + scatter;
+            if (manyLights > 0) {
+                lo = std::max(lo, -L_ROOM);
+                hi = std::min(hi,  L_ROOM);
+            }
+            pos[k] = glm::linearRand(lo, hi);
+        }
+        if (manyLights > 0) {
+            colour = 14.f * vec3(glm::linearRand(0.2f, 1.8f), glm::linearRand(0.2f, 1.8f), glm::linearRand(0.2f, 1.8f));
+        }
         Light newLight = {.colour = colour, .position = pos} ;
         light_points.push_back(newLight);
     }
+    BuildLightTree(lightTree, light_points);
+    areaLight = MakeQuadLight(light_origin, L_SCATTER, 14.f * vec3(1, 1, 1));
 }
 
 
-// Calculate direct lighting and depth of shadows
+// Calculate direct lighting and depth of shadows. The result is the mean over
+// all light points; with more lights than LIGHT_BUDGET it is estimated from a
+// few lights importance sampled from the light tree.
 vec3 DirectLight( const Intersection& intersection,
                   const vector<Object*>& objects,
-                  const vector<Light>& light_points ) {
+                  const vector<Light>& light_points,
+                  uint32_t seed ) {
 
     // Object tri = objects[intersection.objectIndex];
     vec4 normal = objects[intersection.objectIndex]->ComputeNormal(intersection.position);
     vec3 totalColur = vec3(0, 0, 0);
+    int nLights = light_points.size();
 
-    for (int i = 0; i < LIGHT_SAMPLES; i++) {
-        vec4 r = normalize(light_points[i].position - intersection.position);
-        vec3 colour = light_points[i].colour;
-        float length_v = glm::length(light_points[i].position - intersection.position);
-
-        Intersection shadowIntersection;
-        if (ClosestIntersection(intersection.position + 0.000001f*r, r, objects, shadowIntersection, -1)) {
-            if (shadowIntersection.distance <= length_v) {
-                colour = vec3(0, 0, 0);
-                if (darkF && shadowIntersection.shadowCount > 2) colour = vec3(-6, -6, -6);
-            }
+    // Area light: a jittered grid over the quad, shifted per pixel, with each
+    // sample weighted by the cosine at the light. The grid is the squarest
+    // nx * ny that is exactly AREA_SAMPLES, down to 1 x n for a prime count.
+    if (areaF) {
+        uint32_t rng = HashSeed(seed);
+        int n  = std::max(1, AREA_SAMPLES);
+        int nx = std::max(1, (int)std::sqrt((float)n));
+        while (n % nx != 0) nx--;
+        int ny = n / nx;
+        float offU = NextRandom(rng), offV = NextRandom(rng);
+        for (int i = 0; i < nx * ny; i++) {
+            float u, v;
+            StratifiedSample(i, nx, ny, offU, offV, rng, u, v);
+            vec4 q = SampleAreaLight(areaLight, u, v);
+            vec4 r = normalize(intersection.position - q);
+            float cosLight = std::max(0.f, glm::dot(vec3(r.x, r.y, r.z), areaLight.normal));
+            Light sample = {.colour = areaLight.colour * cosLight, .position = q};
+            totalColur += LightContribution(intersection, normal, sample, objects);
         }
+        return totalColur / float(nx * ny);
+    }
 
-        float A = (4.f * PI * length_v * length_v);
-        vec3  B = colour / A;
-        float C = glm::dot(r, normal);
-        vec3 D = B * C;
-        totalColur += D;
+    if (LIGHT_BUDGET <= 0 || nLights <= LIGHT_BUDGET) {
+        for (int i = 0; i < nLights; i++) {
+            totalColur += LightContribution(intersection, normal, light_points[i], objects);
+        }
+    } else {
+        uint32_t rng = HashSeed(seed);
+        vec3 p = vec3(intersection.position.x, intersection.position.y, intersection.position.z);
+        vec3 n = vec3(normal.x, normal.y, normal.z);
+        for (int i = 0; i < LIGHT_BUDGET; i++) {
+            float pdf;
+            int light = SampleLightTree(lightTree, p, n, NextRandom(rng), pdf);
+            if (light < 0) continue;
+            totalColur += LightContribution(intersection, normal, light_points[light], objects) / pdf;
+        }
+        totalColur /= LIGHT_BUDGET;
     }
 
-    totalColur /= LIGHT_SAMPLES;
+    totalColur /= nLights;
     return totalColur;
 }
 
 
+// Light arriving from a single light point, zero if it is occluded
+vec3 LightContribution( const Intersection& intersection,
+                        const vec4 normal,
+                        const Light& light,
+                        const vector<Object*>& objects ) {
+
+    vec4 r = normalize(light.position - intersection.position);
+    vec3 colour = light.colour;
+    float length_v = glm::length(light.position - intersection.position);
+
+    Intersection shadowIntersection;
+    if (ClosestIntersection(intersection.position + 0.000001f*r, r, objects, shadowIntersection, -1)) {
+        if (shadowIntersection.distance <= length_v) {
+            colour = vec3(0, 0, 0);
+            if (darkF && shadowIntersection.shadowCount > 2) colour = vec3(-6, -6, -6);
+        }
+    }
+
+    // Lights behind the surface contribute nothing rather than negative light,
+    // which is also what the light tree assumes when it skips them
+    float A = (4.f * PI * length_v * length_v);
+    vec3  B = colour / A;
+    float C = std::max(0.f, glm::dot(r, normal));
+    vec3 D = B * C;
+    return D;
+}
+
+
 // Find the closest intersection between a ray and a triangle
 // Take in start s, direction dir, and all the triangles
 // Return true if intersection found, and the intersection
@@ -195,21 +424,50 @@ bool ClosestIntersection( const vec4 s,
     bool found = false;
     float t = intersection.distance;
 
-    for (uint32_t i = 0; i < objects.size(); i++) {
-        if (objects[i]->intersect(s, dir, t, position)) {
-            if (t < intersection.distance) {
-                found = true;
-                intersection.shadowCount += 1;
-                intersection.objectIndex = i;
-                intersection.distance = t;
-                intersection.position = position;
+    if (heatF) costCounters.rays += 1;
+    if (wbvhF) {
+        // shadowCount counts improvements in traversal order rather than
+        // object order, so --dark shades slightly differently
+        WideHit hit;
+        found = fullBVHF ? TraverseWideBVH(fullBVH, s, dir, hit)
+                         : TraverseWideBVH(wideBVH, s, dir, hit);
+        if (heatF) costCounters.tests += hit.tests;
+        if (found) {
+            intersection.shadowCount = hit.improvements;
+            intersection.objectIndex = hit.objectIndex;
+            intersection.distance = hit.distance;
+            intersection.position = hit.position;
+        }
+    } else {
+        if (heatF) costCounters.tests += objects.size();
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            if (objects[i]->intersect(s, dir, t, position)) {
+                if (t < intersection.distance) {
+                    found = true;
+                    intersection.shadowCount += 1;
+                    intersection.objectIndex = i;
+                    intersection.distance = t;
+                    intersection.position = position;
+                }
             }
         }
     }
 
+    ColourBleed(dir, objects, intersection, found, global_lum);
+    return found;
+}
+
+
+// Glossy surfaces pick up the colour of nearby surfaces in their reflection
+void ColourBleed( const vec4 dir,
+                  const vector<Object*>& objects,
+                  Intersection& intersection,
+                  bool found,
+                  const int global_lum) {
+
     intersection.colourBleed = vec3(0, 0, 0);
     intersection.colourBleedAmount = 0;
-    if (bleed && global_lum > 0 && global_lum < 3) {
+    if (found && bleed && global_lum > 0 && global_lum < 3) {
         if (Gloss == objects[intersection.objectIndex]->material) {
             vec4 reflektor = reflekt(dir, objects[intersection.objectIndex]->ComputeNormal(intersection.position));
             Intersection bounced;
@@ -224,6 +482,33 @@ bool ClosestIntersection( const vec4 s,
             }
         }
     }
+}
+
+
+// Primary hit for sample i of pixel (x, y), read from the visibility buffer.
+// The stored object is intersected once more to recover the hit position.
+bool PrimaryIntersection( int x, int y, int i,
+                          const vec4 dir,
+                          const vector<Object*>& objects,
+                          Intersection& intersection) {
+
+    const VisSample& sample = visibility.at(x, y, i);
+    intersection.distance = std::numeric_limits<float>::max();
+    intersection.shadowCount = 0;
+    bool found = false;
+    // Counted as a ray, as the traced primary ray it replaces would be
+    if (heatF) costCounters.rays += 1;
+    if (sample.objectIndex >= 0) {
+        if (heatF) costCounters.tests += 1;
+        float t;
+        vec4 position;
+        found = objects[sample.objectIndex]->intersect(camera.position, dir, t, position);
+        intersection.shadowCount = 1;
+        intersection.objectIndex = sample.objectIndex;
+        intersection.distance = t;
+        intersection.position = position;
+    }
+    ColourBleed(dir, objects, intersection, found, 1);
     return found;
 }
 
@@ -240,15 +525,23 @@ void Draw( screen* screen,
            const vector<Object*>& objects,
            const vector<Light>& light_points ) {
 
-    memset(screen->buffer, 0, screen->height*screen->width*sizeof(uint32_t));
-    const float delta_x[9] = {0, 0,    0.25,  0,   -0.25, 0.1,  0.1, -0.1, -0.1}; // SSAA change in ray X direction
-    const float delta_y[9] = {0, 0.25, 0,    -0.25, 0,    0.1, -0.1, -0.1,  0.1}; // SSAA change in ray Y direction
+    if (rasterF) {
+        RasterizePrimary(visibility, objects, camera.R, camera.F, camera.position,
+                         SCREEN_WIDTH, SCREEN_HEIGHT, delta_x, delta_y, softN);
+    }
 
-    #pragma omp parallel for
-    for (int x = 0; x < SCREEN_WIDTH; x++) {
-        for (int y = 0; y < SCREEN_HEIGHT; y++) {
-            vector<Intersection>intersections;
-            vector<bool>founds;
+    if (denoiseF) ResizeDenoiseBuffer(denoiseBuffer, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    // Rows are split into contiguous bands in the same static schedule that
+    // AllocateFramebuffer first-touched them with, so each thread writes to
+    // framebuffer pages on its own NUMA node
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint64_t startCycles = heatF ? ReadCycles() : 0;
+            CostCounters startCost = costCounters;
+            Intersection* intersections = renderContext.intersections;
+            bool* founds = renderContext.founds;
             int reflektorCount = 0;
 
             // Generate all directions and intersections
@@ -257,7 +550,8 @@ void Draw( screen* screen,
             for (int i = 0; i < softN; i++) {
                 vec4 dir = vec4(x - SCREEN_WIDTH/2 +delta_x[i], y - SCREEN_HEIGHT/2 +delta_y[i], camera.F, 1.0);
                 Intersection intersection;
-                bool found = ClosestIntersection(camera.position, camera.R * dir, objects, intersection, 1);
+                bool found = rasterF ? PrimaryIntersection(x, y, i, camera.R * dir, objects, intersection)
+                                     : ClosestIntersection(camera.position, camera.R * dir, objects, intersection, 1);
 
                 vec4 incident  = camera.R * dir;
                 while (found && mirrorF && objects[intersection.objectIndex]->material == Mirror && reflektorCount < 3) {
@@ -278,8 +572,8 @@ void Draw( screen* screen,
                 //     ClosestIntersection(temp.position + (0.0001f * T), T, triangles, intersection);
                 // }
 
-                intersections.push_back(intersection);
-                founds.push_back(found);
+                intersections[i] = intersection;
+                founds[i] = found;
             }
 
             // For all found intersections, average the colour values
@@ -295,9 +589,31 @@ void Draw( screen* screen,
             }
             colour /= N;
 
+            // With denoising, keep albedo, lighting and the primary hit's
+            // features for the filter, and draw once the frame is done
+            if (denoiseF) {
+                int p = DenoiseIndex(denoiseBuffer, x, y);
+                vec3 direct = vec3(0, 0, 0);
+                uint32_t feature = 0;
+                if (founds[0]) {
+                    const Intersection& hit = intersections[0];
+                    vec4 n = objects[hit.objectIndex]->ComputeNormal(hit.position);
+                    direct  = DirectLight(hit, objects, light_points, y*SCREEN_WIDTH + x);
+                    feature = DenoiseFeature(n.x, n.y, n.z, glm::length(hit.position - camera.position),
+                                             hit.objectIndex);
+                    colour *= (1 - (0.15 * reflektorCount));
+                } else {
+                    colour = vec3(0, 0, 0);
+                }
+                for (int c = 0; c < 3; c++) {
+                    denoiseBuffer.albedo[c][p]   = colour[c];
+                    denoiseBuffer.light[0][c][p] = direct[c];
+                }
+                denoiseBuffer.feature[p] = feature;
+            }
             // Draw the pixel values on the screen
-            if (founds[0]) {
-                vec3 totalLight = DirectLight(intersections[0], objects, light_points) + (0.5f*vec3(1,1,1));
+            else if (founds[0]) {
+                vec3 totalLight = DirectLight(intersections[0], objects, light_points, y*SCREEN_WIDTH + x) + (0.5f*vec3(1,1,1));
                 colour *= totalLight;
                 colour *= (1 - (0.15 * reflektorCount));
                 // if (through_glass) colour *= 0.8;
@@ -305,11 +621,415 @@ void Draw( screen* screen,
             } else {
                 PutPixelSDL(screen, x, y, vec3(0.0, 0.0, 0.0));
             }
+
+            if (heatF) {
+                int p = y * SCREEN_WIDTH + x;
+                heatmap.cycles[p] = ReadCycles() - startCycles;
+                heatmap.rays[p]   = costCounters.rays  - startCost.rays;
+                heatmap.tests[p]  = costCounters.tests - startCost.tests;
+            }
+        }
+    }
+
+    if (denoiseF) {
+        double start = omp_get_wtime();
+        DenoiseLighting(denoiseBuffer);
+        denoiseMs = 1000.0 * (omp_get_wtime() - start);
+
+        const std::vector<float>* light = denoiseBuffer.light[denoiseBuffer.current];
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < SCREEN_HEIGHT; y++) {
+            for (int x = 0; x < SCREEN_WIDTH; x++) {
+                int p = DenoiseIndex(denoiseBuffer, x, y);
+                vec3 colour = vec3(0, 0, 0);
+                if (denoiseBuffer.feature[p] != 0) {
+                    for (int c = 0; c < 3; c++) {
+                        colour[c] = denoiseBuffer.albedo[c][p] * (light[c][p] + 0.5f);
+                    }
+                }
+                PutPixelSDL(screen, x, y, colour);
+            }
         }
     }
 }
 
 
+// Mean squared difference between two renders over all 8-bit channels. If diff
+// is given it receives the absolute difference, amplified 4x to be visible.
+float ImageRMSE( const screen* a, const screen* b, screen* diff ) {
+    double sum = 0;
+    for (int i = 0; i < a->width * a->height; i++) {
+        uint32_t out = 128u << 24;
+        for (int shift = 0; shift < 24; shift += 8) {
+            int d = int((a->buffer[i] >> shift) & 0xff) - int((b->buffer[i] >> shift) & 0xff);
+            sum += d * d;
+            out |= uint32_t(std::min(255, 4 * std::abs(d))) << shift;
+        }
+        if (diff) diff->buffer[i] = out;
+    }
+    return std::sqrt(sum / (3.0 * a->width * a->height));
+}
+
+
+// Mean over all 8-bit channels of a render
+float ImageMean( const screen* s ) {
+    double sum = 0;
+    for (int i = 0; i < s->width * s->height; i++) {
+        for (int shift = 0; shift < 24; shift += 8) sum += (s->buffer[i] >> shift) & 0xff;
+    }
+    return sum / (3.0 * s->width * s->height);
+}
+
+
+// Render headless with the point-cloud soft light and with the area light at
+// a few sample counts, and compare each against a converged render of the
+// same light. Difference images are saved as diff_<light>_<samples>.bmp.
+// The caller's lights are regenerated afterwards, since the report rebuilds
+// the light tree and area light for each setup.
+void AreaLightReport( const vector<Object*>& objects,
+                      vector<Light>& light_points ) {
+    const int REFERENCE_SAMPLES = 256;
+    const int pointCounts[3] = {70, 16, 8};
+    const int areaCounts[3]  = {4, 8, 16};
+
+    screen* reference = InitializeOffscreen(SCREEN_WIDTH, SCREEN_HEIGHT);
+    screen* image     = InitializeOffscreen(SCREEN_WIDTH, SCREEN_HEIGHT);
+    screen* diff      = InitializeOffscreen(SCREEN_WIDTH, SCREEN_HEIGHT);
+    vector<Light> report_points;
+    bool savedArea       = areaF;
+    int savedBudget      = LIGHT_BUDGET;
+    int savedSamples     = LIGHT_SAMPLES;
+    int savedAreaSamples = AREA_SAMPLES;
+    LIGHT_BUDGET = 0;
+
+    printf("%-8s %12s %10s %8s %8s\n", "light", "shadow rays", "time (ms)", "RMSE", "PSNR");
+    for (int area = 0; area < 2; area++) {
+        areaF = area;
+        LIGHT_SAMPLES = AREA_SAMPLES = REFERENCE_SAMPLES;
+        GenerateLight(report_points);
+        Draw(reference, objects, report_points);
+
+        for (int c = 0; c < 3; c++) {
+            int n = area ? areaCounts[c] : pointCounts[c];
+            LIGHT_SAMPLES = AREA_SAMPLES = n;
+            GenerateLight(report_points);
+
+            double start = omp_get_wtime();
+            Draw(image, objects, report_points);
+            double ms = 1000.0 * (omp_get_wtime() - start);
+
+            float rmse = ImageRMSE(image, reference, diff);
+            float psnr = rmse > 0 ? 20.f * std::log10(255.f / rmse) : INFINITY;
+            printf("%-8s %12d %10.1f %8.3f %8.2f\n", area ? "area" : "points", n, ms, rmse, psnr);
+
+            std::string name = std::string("diff_") + (area ? "area_" : "points_") + std::to_string(n) + ".bmp";
+            SDL_SaveImage(diff, name.c_str());
+        }
+    }
+
+    areaF         = savedArea;
+    LIGHT_BUDGET  = savedBudget;
+    LIGHT_SAMPLES = savedSamples;
+    AREA_SAMPLES  = savedAreaSamples;
+    GenerateLight(light_points);
+    KillOffscreen(reference);
+    KillOffscreen(image);
+    KillOffscreen(diff);
+}
+
+
+// Render the same frame headless with 1..N threads, N being --threads or the
+// number of CPUs, and report the speedup and parallel efficiency of each
+void ScalingReport( const vector<Object*>& objects,
+                    const vector<Light>& light_points ) {
+    int maxThreads = nThreads > 0 ? nThreads : omp_get_num_procs();
+    screen* image = InitializeOffscreen(SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    printf("%8s %10s %8s %10s\n", "threads", "time (ms)", "speedup", "efficiency");
+    double base = 0;
+    for (int t = 1; t <= maxThreads; t++) {
+        ConfigureThreads(t, pinPolicy);
+        Draw(image, objects, light_points);     // warm up caches and the thread team
+
+        double start = omp_get_wtime();
+        Draw(image, objects, light_points);
+        double ms = 1000.0 * (omp_get_wtime() - start);
+        if (t == 1) base = ms;
+        printf("%8d %10.1f %8.2f %9.0f%%\n", t, ms, base / ms, 100.0 * base / (ms * t));
+    }
+
+    ConfigureThreads(maxThreads, pinPolicy);
+    KillOffscreen(image);
+}
+
+
+// Compare the rasterized primary hits against ray tracing for every pixel
+// sample of the current frame, and time both
+void RasterReport( const vector<Object*>& objects ) {
+
+    double start = omp_get_wtime();
+    RasterizePrimary(visibility, objects, camera.R, camera.F, camera.position,
+                     SCREEN_WIDTH, SCREEN_HEIGHT, delta_x, delta_y, softN);
+    double rasterMs = 1000.0 * (omp_get_wtime() - start);
+
+    long mismatches = 0;
+    start = omp_get_wtime();
+    #pragma omp parallel for schedule(static) reduction(+:mismatches)
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            for (int i = 0; i < softN; i++) {
+                vec4 dir = vec4(x - SCREEN_WIDTH/2 +delta_x[i], y - SCREEN_HEIGHT/2 +delta_y[i], camera.F, 1.0);
+                Intersection intersection;
+                bool found = ClosestIntersection(camera.position, camera.R * dir, objects, intersection, 0);
+                const VisSample& sample = visibility.at(x, y, i);
+                if (found != (sample.objectIndex >= 0) ||
+                    (found && (intersection.objectIndex != sample.objectIndex ||
+                               intersection.distance    != sample.depth))) {
+                    mismatches++;
+                }
+            }
+        }
+    }
+    double traceMs = 1000.0 * (omp_get_wtime() - start);
+
+    printf("Primary visibility, %d samples per pixel\n", softN);
+    printf("  ray traced: %8.1f ms\n", traceMs);
+    printf("  rasterized: %8.1f ms\n", rasterMs);
+    printf("  mismatched samples: %ld\n", mismatches);
+}
+
+
+// Render every keyframe of a camera path headless. Finished frames go to an
+// I/O thread through a small pool of buffers, so writing one frame overlaps
+// with rendering the next. Progress goes to stderr, as stdout may carry Y4M.
+// Returns false if the keyframe file is missing, malformed or empty.
+bool RenderSequence( const vector<Object*>& objects ) {
+    const int PIPELINE_DEPTH = 3;
+
+    vector<Keyframe> keyframes;
+    if (!LoadKeyframes(sequencePath, keyframes)) return false;
+
+    FrameWriter writer;
+    OpenFrameWriter(writer, sequenceOut, sequenceStream, SCREEN_WIDTH, SCREEN_HEIGHT);
+    FramePipeline pipeline;
+    StartPipeline(pipeline, writer, PIPELINE_DEPTH);
+
+    vector<Light> light_points;
+    double renderSeconds = 0;
+    double start = omp_get_wtime();
+    for (uint32_t f = 0; f < keyframes.size(); f++) {
+        camera.position = keyframes[f].position;
+        yaw             = keyframes[f].yaw;
+        camera.R        = YawMatrix(yaw);
+        light_origin    = keyframes[f].light;
+        GenerateLight(light_points);
+
+        int buffer = AcquireFrameBuffer(pipeline);
+        screen frame = {0, 0, 0, SCREEN_HEIGHT, SCREEN_WIDTH, pipeline.buffers[buffer]};
+        double frameStart = omp_get_wtime();
+        Draw(&frame, objects, light_points);
+        renderSeconds += omp_get_wtime() - frameStart;
+        SubmitFrameBuffer(pipeline, buffer, f);
+        std::cerr << "Frame " << f + 1 << "/" << keyframes.size() << "\r" << std::flush;
+    }
+    FinishPipeline(pipeline);
+    double total = omp_get_wtime() - start;
+
+    int n = keyframes.size();
+    std::cerr << std::endl
+              << n << " frames in " << total << " s: " << n / total << " frames/sec sustained" << std::endl
+              << "  render " << 1000.0 * renderSeconds / n << " ms/frame, "
+              << "write " << 1000.0 * pipeline.ioSeconds / n << " ms/frame (overlapped)" << std::endl;
+    return true;
+}
+
+
+// Memory footprint of the wide BVH and its float-box copy, and primary plus
+// shadow ray throughput of the linear loop against each of them
+void BVHReport( const vector<Object*>& objects ) {
+    const char* names[3] = {"linear:", "full:", "wbvh:"};
+    uint32_t nPrims = objects.size();
+    size_t quantized = wideBVH.nodeCount * sizeof(WideNode);
+    size_t full      = fullBVH.nodes.size() * sizeof(FullWideNode);
+    size_t leaves    = wideBVH.primCount * sizeof(PackedObject);
+
+    printf("Wide BVH: %u nodes, %u primitives\n", wideBVH.nodeCount, nPrims);
+    printf("  quantized nodes: %10zu bytes, %6.1f bytes/primitive (%zu-byte nodes)\n",
+           quantized, float(quantized) / nPrims, sizeof(WideNode));
+    printf("  full nodes:      %10zu bytes, %6.1f bytes/primitive (%zu-byte nodes)\n",
+           full, float(full) / nPrims, sizeof(FullWideNode));
+    printf("  leaf primitives: %10zu bytes, %6.1f bytes/primitive (shared by both)\n",
+           leaves, float(leaves) / nPrims);
+
+    vector<int> linearHits(SCREEN_WIDTH * SCREEN_HEIGHT * 2);
+    long mismatches[3] = {0, 0, 0};
+    bool savedWbvh = wbvhF, savedFull = fullBVHF;
+    for (int pass = 0; pass < 3; pass++) {
+        wbvhF    = pass > 0;
+        fullBVHF = pass == 1;
+        long passMismatches = 0;
+        double start = omp_get_wtime();
+        #pragma omp parallel for schedule(static) reduction(+:passMismatches)
+        for (int y = 0; y < SCREEN_HEIGHT; y++) {
+            for (int x = 0; x < SCREEN_WIDTH; x++) {
+                vec4 dir = vec4(x - SCREEN_WIDTH/2, y - SCREEN_HEIGHT/2, camera.F, 1.0);
+                Intersection primary, shadow;
+                int hits[2] = {-1, -1};
+                if (ClosestIntersection(camera.position, camera.R * dir, objects, primary, 0)) {
+                    hits[0] = primary.objectIndex;
+                    vec4 r = normalize(light_origin - primary.position);
+                    if (ClosestIntersection(primary.position + 0.000001f*r, r, objects, shadow, 0)) {
+                        hits[1] = shadow.objectIndex;
+                    }
+                }
+                for (int k = 0; k < 2; k++) {
+                    int& slot = linearHits[(y * SCREEN_WIDTH + x) * 2 + k];
+                    if (pass == 0) slot = hits[k];
+                    else if (slot != hits[k]) passMismatches++;
+                }
+            }
+        }
+        double seconds = omp_get_wtime() - start;
+        mismatches[pass] = passMismatches;
+        printf("  %-7s %8.3f Mrays/sec\n", names[pass], 2.0 * SCREEN_WIDTH * SCREEN_HEIGHT / seconds / 1e6);
+    }
+    printf("  mismatched hits: full %ld, wbvh %ld\n", mismatches[1], mismatches[2]);
+    wbvhF    = savedWbvh;
+    fullBVHF = savedFull;
+}
+
+
+// Compare few-ray renders, with and without the denoiser, against the full
+// 70-point soft light traced at every pixel, then time the filter alone on
+// the last frame. The caller's lights are regenerated afterwards.
+void DenoiseReport( const vector<Object*>& objects,
+                    vector<Light>& light_points ) {
+    const int budgets[2] = {4, 8};
+    screen* reference = InitializeOffscreen(SCREEN_WIDTH, SCREEN_HEIGHT);
+    screen* image     = InitializeOffscreen(SCREEN_WIDTH, SCREEN_HEIGHT);
+    bool savedDenoise = denoiseF;
+    int savedBudget   = LIGHT_BUDGET;
+    int savedSamples  = LIGHT_SAMPLES;
+
+    LIGHT_SAMPLES = 70;
+    GenerateLight(light_points);
+
+    denoiseF     = false;
+    LIGHT_BUDGET = 0;
+    double start = omp_get_wtime();
+    Draw(reference, objects, light_points);
+    double referenceMs = 1000.0 * (omp_get_wtime() - start);
+
+    printf("%-10s %12s %10s %12s %8s %8s\n", "mode", "shadow rays", "time (ms)", "filter (ms)", "RMSE", "PSNR");
+    printf("%-10s %12d %10.1f %12s %8s %8s\n", "reference", LIGHT_SAMPLES, referenceMs, "-", "-", "-");
+    for (int b = 0; b < 2; b++) {
+        for (int filtered = 0; filtered < 2; filtered++) {
+            LIGHT_BUDGET = budgets[b];
+            denoiseF     = filtered;
+            denoiseMs    = 0;
+            start = omp_get_wtime();
+            Draw(image, objects, light_points);
+            double ms = 1000.0 * (omp_get_wtime() - start);
+
+            float rmse = ImageRMSE(image, reference, NULL);
+            printf("%-10s %12d %10.1f %12.2f %8.3f %8.2f\n", filtered ? "denoised" : "noisy",
+                   budgets[b], ms, denoiseMs, rmse, 20.f * std::log10(255.f / rmse));
+        }
+    }
+
+    // The filter has no data-dependent branches, so rerunning it on a copy of
+    // the last frame's buffers times it without the noise of a full render
+    const int RUNS = 10;
+    double best = 1e30, total = 0;
+    for (int run = 0; run < RUNS; run++) {
+        DenoiseBuffer timing = denoiseBuffer;
+        timing.current = 0;
+        start = omp_get_wtime();
+        DenoiseLighting(timing);
+        double ms = 1000.0 * (omp_get_wtime() - start);
+        best   = std::min(best, ms);
+        total += ms;
+    }
+    printf("filter at %dx%d on %d threads: best %.2f ms, mean %.2f ms over %d runs\n",
+           SCREEN_WIDTH, SCREEN_HEIGHT, omp_get_max_threads(), best, total / RUNS, RUNS);
+
+    denoiseF      = savedDenoise;
+    LIGHT_BUDGET  = savedBudget;
+    LIGHT_SAMPLES = savedSamples;
+    GenerateLight(light_points);
+    KillOffscreen(reference);
+    KillOffscreen(image);
+}
+
+
+// Render a few frames with the current flags and count the heap allocations
+// each one makes. The first frame sizes the long-lived buffers; every frame
+// after it should allocate nothing. Returns false if one did.
+bool AllocationReport( const vector<Object*>& objects,
+                       const vector<Light>& light_points ) {
+    if (!ALLOCATIONS_COUNTED) {
+        std::cerr << "--alloc-check needs a build with -DCOUNT_ALLOCATIONS (make alloc-check)" << std::endl;
+        return false;
+    }
+
+    const int frames = 4;
+    screen* image = InitializeOffscreen(SCREEN_WIDTH, SCREEN_HEIGHT);
+    bool steady = true;
+
+    printf("%6s %12s %10s\n", "frame", "allocations", "time (ms)");
+    for (int f = 0; f < frames; f++) {
+        uint64_t before = HeapAllocations();
+        double start = omp_get_wtime();
+        Draw(image, objects, light_points);
+        double ms = 1000.0 * (omp_get_wtime() - start);
+        uint64_t count = HeapAllocations() - before;
+        printf("%6d %12llu %10.1f\n", f, (unsigned long long)count, ms);
+        if (f > 0 && count > 0) steady = false;
+    }
+    printf(steady ? "Steady-state frames are allocation free\n"
+                  : "Steady-state frames allocate on the heap\n");
+
+    KillOffscreen(image);
+    return steady;
+}
+
+
+// Render with every light evaluated, then with growing light-tree budgets.
+// The sampled estimate is unbiased, so its mean should match and its error
+// should keep falling as the budget grows. Returns false if it stops falling.
+bool LightTreeReport( const vector<Object*>& objects,
+                      const vector<Light>& light_points ) {
+    const int budgets[4] = {4, 16, 64, 256};
+    screen* reference = InitializeOffscreen(SCREEN_WIDTH, SCREEN_HEIGHT);
+    screen* image     = InitializeOffscreen(SCREEN_WIDTH, SCREEN_HEIGHT);
+    int savedBudget   = LIGHT_BUDGET;
+
+    LIGHT_BUDGET = 0;
+    Draw(reference, objects, light_points);
+
+    printf("%d lights\n", (int)light_points.size());
+    printf("%-10s %12s %8s %8s\n", "budget", "mean pixel", "RMSE", "PSNR");
+    printf("%-10s %12.2f %8s %8s\n", "all", ImageMean(reference), "-", "-");
+    bool converges = true;
+    float previous = std::numeric_limits<float>::max();
+    for (int b = 0; b < 4; b++) {
+        LIGHT_BUDGET = budgets[b];
+        Draw(image, objects, light_points);
+        float rmse = ImageRMSE(image, reference, NULL);
+        printf("%-10d %12.2f %8.3f %8.2f\n", budgets[b], ImageMean(image), rmse, 20.f * std::log10(255.f / rmse));
+        if (rmse > 0 && rmse >= previous) converges = false;
+        previous = rmse;
+    }
+    printf(converges ? "Light-tree estimate converges to the exhaustive render\n"
+                     : "Light-tree estimate does not converge to the exhaustive render\n");
+
+    LIGHT_BUDGET = savedBudget;
+    KillOffscreen(reference);
+    KillOffscreen(image);
+    return converges;
+}
+
+
 void Update( vector<Light>& light_points ) {
     static int t = SDL_GetTicks();
     int t2 = SDL_GetTicks();
@@ -359,14 +1079,19 @@ void Update( vector<Light>& light_points ) {
     }
 
     if (rot) {
-        camera.R = mat4(cos(yaw), 0, sin(yaw), 0,
-                               0, 1, 0       , 0,
-                       -sin(yaw), 0, cos(yaw), 0,
-                               0, 0, 0       , 1);
+        camera.R = YawMatrix(yaw);
     }
 }
 
 
+mat4 YawMatrix( float yaw ) {
+    return mat4(cos(yaw), 0, sin(yaw), 0,
+                       0, 1, 0       , 0,
+               -sin(yaw), 0, cos(yaw), 0,
+                       0, 0, 0       , 1);
+}
+
+
 // Calculate if light is reflected or refracted in a material made of glass.
 // Couldn't fully implement therefore this function is not called.
 // vec4 refract(const vec4 dir, const vector<Object*>& objects, Intersection& intersection) {